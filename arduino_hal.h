@@ -0,0 +1,508 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_ARDUINO_HAL_H
+#define PULPUTIN_ARDUINO_HAL_H
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#ifdef USE_ASYNC_I2C
+  #include "twi_queue.h"
+  #include "lcd_i2c.h"
+  #include "ds3231.h"
+#else
+  #include <Wire.h>
+  #include <LiquidCrystal_I2C.h>
+  #include <RTClib.h>
+#endif
+#include <OneWire.h>
+#include <DallasTemperature.h>
+#include "hal.h"
+
+static const uint16_t ONE_WIRE_PIN = 30; // Temperature sensor
+static const uint16_t OUT_HEATER_PIN = 34;
+
+#if defined(USE_PIN_WAKE) && !defined(__AVR_ATmega2560__)
+  #error "USE_PIN_WAKE uses pin change interrupts of the Mega"
+#endif
+#if defined(USE_ASYNC_I2C) && !defined(__AVR_ATmega2560__)
+  #error "USE_ASYNC_I2C uses the TWI pins of the Mega"
+#endif
+#if defined(USE_UPLINK) && !defined(__AVR_ATmega2560__)
+  #error "USE_UPLINK uses a spare serial port of the Mega"
+#endif
+
+#ifdef USE_PIN_WAKE
+// Buttons 1-6 moved to A8-A13 (port K, PCINT16-21), so that every button
+// can wake the MCU from power down
+static const uint16_t BUTTON1_PIN = A8;
+static const uint16_t BUTTON2_PIN = A9;
+static const uint16_t BUTTON3_PIN = A10;
+static const uint16_t BUTTON4_PIN = A11;
+static const uint16_t BUTTON5_PIN = A12;
+static const uint16_t BUTTON6_PIN = A13;
+#else
+static const uint16_t BUTTON1_PIN = 39;
+static const uint16_t BUTTON2_PIN = 41;
+static const uint16_t BUTTON3_PIN = 43;
+static const uint16_t BUTTON4_PIN = 45;
+static const uint16_t BUTTON5_PIN = 47;
+static const uint16_t BUTTON6_PIN = 49;
+#endif
+static const uint16_t BUTTON7_PIN = 51; // PCINT2
+static const uint16_t BUTTON8_PIN = 53; // PCINT0
+
+static const uint16_t WATER_LEVEL_PIN = 48;
+
+static const uint16_t IN_MOISTURE1_PIN = A0;
+
+static const uint16_t OUT_PUMP_PIN = 4; // PWM by Timer0, 976 Hz
+static const uint16_t ALARM_PIN = 3;
+
+static const uint16_t MOTION_PIN = 52; // PCINT1
+static const uint16_t MOTION_GROUND_PIN = 50;
+
+// Number of pots watered by this board, at most MAX_ZONES
+static const uint8_t ZONE_COUNT = 1;
+
+// Pins of each zone. Zone 0 is the original single pot wiring. Pump pins must
+// be PWM pins outside Timer5, which switches the heater. Pins 5-7 are on Timer3
+// and Timer4 in their default 490 Hz PWM mode, Timer3 is shared with the beeper.
+struct ZonePins {
+  uint8_t pump;
+  uint8_t waterLevel;
+  uint8_t moisture; // Analog pin, A0-A7
+};
+
+static const ZonePins ZONE_PINS[MAX_ZONES] = {
+  {OUT_PUMP_PIN, WATER_LEVEL_PIN, IN_MOISTURE1_PIN},
+  {5, 44, A1},
+  {6, 46, A2},
+  {7, 42, A3},
+};
+
+static_assert(ZONE_COUNT >= 1 && ZONE_COUNT <= MAX_ZONES, "Zone count");
+
+#if defined(__AVR_ATmega2560__)
+// Water level pins of ZONE_PINS are all on port L, read at once by readInputs()
+static const uint8_t ZONE_WATER_LEVEL_BITS[MAX_ZONES] = {_BV(1), _BV(5), _BV(3), _BV(7)}; // 48, 44, 46, 42
+#endif
+
+// Optional FRAM for the sensor log, like MB85RC256V. SPI pins of an SD card
+// are taken by buttons and the motion sensor.
+static const uint8_t FRAM_I2C_ADDRESS = 0x50;
+static const uint8_t I2C_BUFFER_SIZE = 32; // Of Wire, address bytes included on writes
+
+static const uint8_t LCD_I2C_ADDRESS = 0x3F;
+static const uint8_t RTC_I2C_ADDRESS = 0x68;
+static const uint8_t RTC_CONTROL_REGISTER = 0x0E;
+
+// INT2 (RX1). Edge interrupts on INT0-INT3 can wake the MCU from power down.
+static const uint16_t RTC_SQW_PIN = 19;
+
+// Uplink coprocessor, TX2 16 and RX2 17. Serial1 is not free, RX1 is RTC_SQW_PIN.
+#define UPLINK_SERIAL Serial2
+
+static_assert(DEVICE_DISCONNECTED_RAW == TEMP_RAW_DISCONNECTED, "DallasTemperature disconnected value");
+
+// Defined in pulputin.ino
+extern DallasTemperature sensors;
+#ifndef USE_ASYNC_I2C
+extern LiquidCrystal_I2C lcd;
+extern DS3231 rtc;
+#endif
+
+// On the Mega outputs are written directly to their port bits. Single bit
+// writes to these low I/O addresses compile to atomic sbi/cbi instructions.
+#if defined(__AVR_ATmega2560__)
+  #define HAL_WRITE_BIT(port, bit, on) do { if (on) port |= _BV(bit); else port &= ~_BV(bit); } while (0)
+#endif
+
+#if defined(__AVR_ATmega2560__)
+#include <util/atomic.h>
+
+// Moisture is sampled by the ADC in free running mode, in the background. Sum of
+// 64 conversions is the 10 bit reading oversampled to 13 bits, scaled to 16 bits.
+// Decimated readings are smoothed by an IIR filter, its state kept with
+// MOISTURE_FILTER_SHIFT fraction bits so that it settles on the reading instead
+// of below it. With several zones the channel is switched after each decimated
+// reading.
+static const uint8_t MOISTURE_OVERSAMPLING = 64;
+static const uint8_t MOISTURE_FILTER_SHIFT = 3; // Time constant of 8 decimated readings, ~50 ms per zone
+
+static volatile uint32_t moistureFiltered[ZONE_COUNT]; // Filtered << MOISTURE_FILTER_SHIFT
+static uint16_t moistureSum = 0;
+static uint8_t moistureCount = 0;
+static uint8_t moistureZone = 0; // Zone being sampled
+static uint8_t moistureFilterStarted = 0; // Bit per zone
+static bool moistureDiscard = false;
+
+inline uint8_t moistureAdmux(uint8_t zone) { return _BV(REFS0) | (ZONE_PINS[zone].moisture - A0); }
+
+ISR(ADC_vect) {
+  uint16_t sample = ADC;
+  // Conversion running while the channel was switched still sampled the previous one
+  if (moistureDiscard) {
+    moistureDiscard = false;
+    return;
+  }
+  moistureSum += sample;
+  if (++moistureCount < MOISTURE_OVERSAMPLING) return;
+  uint8_t zone = moistureZone;
+  if (moistureFilterStarted & _BV(zone)) {
+    moistureFiltered[zone] += moistureSum - (moistureFiltered[zone] >> MOISTURE_FILTER_SHIFT);
+  } else {
+    moistureFiltered[zone] = (uint32_t)moistureSum << MOISTURE_FILTER_SHIFT;
+    moistureFilterStarted |= _BV(zone);
+  }
+  moistureSum = 0;
+  moistureCount = 0;
+  if (ZONE_COUNT > 1) {
+    moistureZone = (zone + 1) % ZONE_COUNT;
+    ADMUX = moistureAdmux(moistureZone);
+    moistureDiscard = true;
+  }
+}
+
+// Timer5 ticks every HEATER_TICK_MS and switches the heater, requested duty is
+// taken into use at the start of each window.
+static volatile uint8_t heaterDuty = 0;
+static volatile uint8_t heaterWindowDuty = 0;
+static uint8_t heaterTick = 0;
+static volatile uint32_t heaterOnTicks = 0;
+static uint8_t heaterSleptMs = 0; // Slept part of a tick, see resumeAfterSleep()
+
+ISR(TIMER5_COMPA_vect) {
+  if (heaterTick == 0) heaterWindowDuty = heaterDuty;
+  bool on = heaterTick < heaterWindowDuty;
+  HAL_WRITE_BIT(PORTC, 3, on); // 34
+  if (on) heaterOnTicks++;
+  if (++heaterTick == HEATER_DUTY_MAX) heaterTick = 0;
+}
+
+#ifdef USE_PIN_WAKE
+// Set by a pin change of a button or the motion sensor. Any pin change
+// interrupt wakes the MCU from power down, the flag tells it was not the
+// watchdog.
+static volatile bool pinWake = false;
+
+ISR(PCINT0_vect) { pinWake = true; } // Buttons 7, 8 and motion
+ISR(PCINT2_vect) { pinWake = true; } // Buttons 1-6
+#endif
+#else
+static bool heaterOn = false;
+static uint32_t heaterOnMs = 0;
+static uint32_t heaterOnChangedMs = 0;
+#endif
+
+#ifndef USE_ASYNC_I2C
+static uint32_t requestedRtc = 0; // Unix time read by requestRtc()
+#endif
+
+struct ArduinoHal {
+  static void begin() {
+    pinMode(BUTTON1_PIN, INPUT_PULLUP);
+    pinMode(BUTTON2_PIN, INPUT_PULLUP);
+    pinMode(BUTTON3_PIN, INPUT_PULLUP);
+    pinMode(BUTTON4_PIN, INPUT_PULLUP);
+    pinMode(BUTTON5_PIN, INPUT_PULLUP);
+    pinMode(BUTTON6_PIN, INPUT_PULLUP);
+    pinMode(BUTTON7_PIN, INPUT_PULLUP);
+    pinMode(BUTTON8_PIN, INPUT_PULLUP);
+    pinMode(MOTION_PIN, INPUT);
+
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      pinMode(ZONE_PINS[zone].moisture, INPUT);
+      pinMode(ZONE_PINS[zone].pump, OUTPUT);
+      digitalWrite(ZONE_PINS[zone].pump, LOW);
+      pinMode(ZONE_PINS[zone].waterLevel, INPUT_PULLUP);
+    }
+    pinMode(OUT_HEATER_PIN, OUTPUT);
+    pinMode(LED_BUILTIN, OUTPUT);
+    pinMode(ALARM_PIN, OUTPUT);
+
+    pinMode(MOTION_GROUND_PIN, OUTPUT);
+    digitalWrite(MOTION_GROUND_PIN, LOW);
+
+    digitalWrite(LED_BUILTIN, LOW);
+    digitalWrite(ALARM_PIN, LOW);
+    digitalWrite(OUT_HEATER_PIN, LOW);
+
+#if defined(__AVR_ATmega2560__)
+    // AVcc reference, moisture channel of zone 0, free running with 125 kHz ADC
+    // clock. analogRead() must not be used after this.
+    ADMUX = moistureAdmux(0);
+    ADCSRB = 0;
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) DIDR0 |= _BV(ZONE_PINS[zone].moisture - A0);
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+
+    // Timer5 in CTC mode with 62.5 kHz clock, compare match every HEATER_TICK_MS
+    TCCR5A = 0;
+    TCCR5B = _BV(WGM52) | _BV(CS52);
+    OCR5A = F_CPU / 256 * HEATER_TICK_MS / 1000 - 1;
+    TIMSK5 = _BV(OCIE5A);
+
+#ifdef USE_PIN_WAKE
+    PCMSK0 = _BV(PCINT0) | _BV(PCINT1) | _BV(PCINT2); // 53, 52, 51
+    PCMSK2 = 0x3F; // A8-A13
+    PCIFR = _BV(PCIF0) | _BV(PCIF2);
+    PCICR = _BV(PCIE0) | _BV(PCIE2);
+#endif
+#endif
+  }
+
+  static uint16_t readInputs() {
+    uint16_t raw = 0;
+#if defined(__AVR_ATmega2560__)
+    // Read each port only once. Pins 39-53 are on ports G, L and B of the Mega.
+    uint8_t l = PINL;
+    uint8_t b = PINB;
+#ifdef USE_PIN_WAKE
+    // Active low buttons 1-6 are the low 6 bits of port K
+    static_assert(INPUT_BUTTON1 == 1 && INPUT_BUTTON6 == 1 << 5, "Buttons 1-6 are bits 0-5");
+    raw |= ~PINK & 0x3F;
+#else
+    uint8_t g = PING;
+    if (!(g & _BV(2))) raw |= INPUT_BUTTON1; // 39
+    if (!(g & _BV(0))) raw |= INPUT_BUTTON2; // 41
+    if (!(l & _BV(6))) raw |= INPUT_BUTTON3; // 43
+    if (!(l & _BV(4))) raw |= INPUT_BUTTON4; // 45
+    if (!(l & _BV(2))) raw |= INPUT_BUTTON5; // 47
+    if (!(l & _BV(0))) raw |= INPUT_BUTTON6; // 49
+#endif
+    if (!(b & _BV(2))) raw |= INPUT_BUTTON7; // 51
+    if (!(b & _BV(0))) raw |= INPUT_BUTTON8; // 53
+    if (b & _BV(1)) raw |= INPUT_MOTION; // 52
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      if (l & ZONE_WATER_LEVEL_BITS[zone]) raw |= inputWaterLevel(zone);
+    }
+#else
+    if (!digitalRead(BUTTON1_PIN)) raw |= INPUT_BUTTON1;
+    if (!digitalRead(BUTTON2_PIN)) raw |= INPUT_BUTTON2;
+    if (!digitalRead(BUTTON3_PIN)) raw |= INPUT_BUTTON3;
+    if (!digitalRead(BUTTON4_PIN)) raw |= INPUT_BUTTON4;
+    if (!digitalRead(BUTTON5_PIN)) raw |= INPUT_BUTTON5;
+    if (!digitalRead(BUTTON6_PIN)) raw |= INPUT_BUTTON6;
+    if (!digitalRead(BUTTON7_PIN)) raw |= INPUT_BUTTON7;
+    if (!digitalRead(BUTTON8_PIN)) raw |= INPUT_BUTTON8;
+    if (digitalRead(WATER_LEVEL_PIN)) raw |= INPUT_WATER_LEVEL;
+    if (digitalRead(MOTION_PIN)) raw |= INPUT_MOTION;
+    for (uint8_t zone = 1; zone < ZONE_COUNT; zone++) {
+      if (digitalRead(ZONE_PINS[zone].waterLevel)) raw |= inputWaterLevel(zone);
+    }
+#endif
+    return raw;
+  }
+
+#if defined(__AVR_ATmega2560__)
+  static uint16_t readMoisture(uint8_t zone) {
+    uint32_t value;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { value = moistureFiltered[zone]; }
+    return value >> MOISTURE_FILTER_SHIFT;
+  }
+  // Power down stops the ADC, free running conversions must be started again.
+  // Timer5 stopped too, the heater window is moved on by the time slept. Sleep
+  // is limited by heaterOffMs(), so it never crosses the start of a window.
+  static void resumeAfterSleep(uint16_t sleptMs) {
+    ADCSRA |= _BV(ADEN) | _BV(ADSC);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      uint16_t ms = sleptMs + heaterSleptMs;
+      uint16_t ticks = ms / HEATER_TICK_MS;
+      heaterSleptMs = ms % HEATER_TICK_MS;
+      if (ticks > HEATER_DUTY_MAX - heaterTick) ticks = HEATER_DUTY_MAX - heaterTick;
+      heaterTick = (heaterTick + ticks) % HEATER_DUTY_MAX;
+    }
+  }
+#else
+  static uint16_t readMoisture(uint8_t zone) { return analogRead(ZONE_PINS[zone].moisture) << 6; }
+  static void resumeAfterSleep(uint16_t) {}
+#endif
+
+#if defined(__AVR_ATmega2560__)
+  static void setHeaterDuty(uint8_t duty) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      heaterDuty = duty;
+      if (duty == 0 || duty == HEATER_DUTY_MAX) heaterWindowDuty = duty;
+    }
+  }
+  static uint32_t readHeaterOnMs() {
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { ticks = heaterOnTicks; }
+    return ticks * HEATER_TICK_MS;
+  }
+  // Heater switches on at the start of the next window, unless duty is zero
+  static uint32_t heaterOffMs() {
+    uint32_t offMs;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if ((PORTC & _BV(3)) || heaterWindowDuty == HEATER_DUTY_MAX) offMs = 0;
+      else if (!heaterDuty) offMs = 0xFFFFFFFF;
+      else offMs = (uint32_t)((HEATER_DUTY_MAX - heaterTick) % HEATER_DUTY_MAX) * HEATER_TICK_MS;
+    }
+    return offMs;
+  }
+  static void setLed(bool on) { HAL_WRITE_BIT(PORTB, 7, on); } // 13
+#else
+  // There is no switching window on other boards, heater is on whenever duty is above zero
+  static void setHeaterDuty(uint8_t duty) {
+    uint32_t now = millis();
+    if (heaterOn) heaterOnMs += now - heaterOnChangedMs;
+    heaterOnChangedMs = now;
+    heaterOn = duty;
+    digitalWrite(OUT_HEATER_PIN, heaterOn ? HIGH : LOW);
+  }
+  static uint32_t readHeaterOnMs() { return heaterOnMs + (heaterOn ? millis() - heaterOnChangedMs : 0); }
+  static uint32_t heaterOffMs() { return heaterOn ? 0 : 0xFFFFFFFF; }
+  static void setLed(bool on) { digitalWrite(LED_BUILTIN, on ? HIGH : LOW); }
+#endif
+  static void setPumpDuty(uint8_t zone, uint8_t duty) { analogWrite(ZONE_PINS[zone].pump, duty); }
+  static void setBeeper(uint8_t duty) { analogWrite(ALARM_PIN, duty); }
+
+  static uint16_t beginTemperature(uint8_t resolution) {
+    sensors.begin();
+    sensors.setResolution(resolution);
+    // Do not block in requestTemperatures(), result is read on a later loop iteration
+    sensors.setWaitForConversion(false);
+    return sensors.millisToWaitForConversion(resolution);
+  }
+  static bool findTemperatureSensor(uint8_t index, SensorAddress &address) { return sensors.getAddress(address.rom, index); }
+  static void requestTemperature() { sensors.requestTemperatures(); }
+  // Addressed read of the scratchpad, without a bus search. Raw temperature is
+  // read without going through float.
+  static int32_t readTemperatureRaw(const SensorAddress &address) { return sensors.getTemp(address.rom); }
+
+#ifdef USE_ASYNC_I2C
+  // At 400 kHz if the RTC and display answer at it, otherwise at 100 kHz
+  static void beginI2c() {
+    Twi::begin(TWI_FAST_HZ);
+    if (Twi::run(RTC_I2C_ADDRESS, NULL, 0, NULL, 0) != TWI_OK || Twi::run(LCD_I2C_ADDRESS, NULL, 0, NULL, 0) != TWI_OK) {
+      Twi::begin(TWI_STANDARD_HZ);
+    }
+  }
+  static void serviceBus() { Twi::service(millis()); }
+  static bool isBusIdle() { return Twi::idle(); }
+
+  static bool beginRtc() {
+    if (Ds3231::isRunning()) return true;
+    Ds3231::adjust(DateTime(__DATE__, __TIME__));
+    return false;
+  }
+  static uint32_t readRtc() { return Ds3231::now(); }
+  static void requestRtc() { Ds3231::request(); }
+  static bool rtcReady(uint32_t &unixTime) { return Ds3231::ready(unixTime); }
+  static void enableRtcSquareWave() { Ds3231::enableSquareWave(); }
+
+  static void beginLcd() { LcdI2c::begin(LCD_I2C_ADDRESS); }
+  static bool setLcdCursor(uint8_t col, uint8_t row) { return LcdI2c::setCursor(col, row); }
+  static bool writeLcd(char c) { return LcdI2c::write(c); }
+  static void setLcdBacklight(bool on) { LcdI2c::setBacklight(on); }
+#else
+  static void beginI2c() { Wire.begin(); }
+  static void serviceBus() {}
+  static bool isBusIdle() { return true; }
+
+  static bool beginRtc() {
+    rtc.begin();
+    if (rtc.isrunning()) return true;
+    rtc.adjust(DateTime(__DATE__, __TIME__));
+    return false;
+  }
+  static uint32_t readRtc() { return rtc.now().unixtime(); }
+  // Wire blocks, so the time is read already on request
+  static void requestRtc() { requestedRtc = readRtc(); }
+  static bool rtcReady(uint32_t &unixTime) {
+    unixTime = requestedRtc;
+    return true;
+  }
+  static void enableRtcSquareWave() {
+    // Control register: INTCN = 0 and RS2:RS1 = 00 gives 1 Hz square wave on SQW
+    Wire.beginTransmission(RTC_I2C_ADDRESS);
+    Wire.write(RTC_CONTROL_REGISTER);
+    Wire.write(0x00);
+    Wire.endTransmission();
+  }
+
+  static void beginLcd() { lcd.init(); }
+  static bool setLcdCursor(uint8_t col, uint8_t row) {
+    lcd.setCursor(col, row);
+    return true;
+  }
+  static bool writeLcd(char c) {
+    lcd.write(c);
+    return true;
+  }
+  static void setLcdBacklight(bool on) {
+    if (on) lcd.backlight();
+    else lcd.noBacklight();
+  }
+#endif
+
+  static void readEeprom(uint16_t address, void *data, uint8_t size) { eeprom_read_block(data, (const void*)(uintptr_t)address, size); }
+  static void writeEeprom(uint16_t address, const void *data, uint8_t size) { eeprom_write_block(data, (void*)(uintptr_t)address, size); }
+  static void updateEepromByte(uint16_t address, uint8_t value) { eeprom_update_byte((uint8_t*)(uintptr_t)address, value); }
+  static void resetWatchdog() { wdt_reset(); }
+
+#ifdef USE_ASYNC_I2C
+  static bool beginFram() { return Twi::run(FRAM_I2C_ADDRESS, NULL, 0, NULL, 0) == TWI_OK; }
+
+  // Waits for the data, after transactions queued before it
+  static void readFram(uint16_t address, void *data, uint8_t size) {
+    uint8_t reg[] = {(uint8_t)(address >> 8), (uint8_t)(address & 0xFF)};
+    Twi::run(FRAM_I2C_ADDRESS, reg, sizeof(reg), (uint8_t*)data, size);
+  }
+
+  // Data is copied into the queue, waits only when the queue is full
+  static void writeFram(uint16_t address, const void *data, uint8_t size) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    while (size) {
+      uint8_t length = size < I2C_BUFFER_SIZE - 2 ? size : I2C_BUFFER_SIZE - 2;
+      uint8_t chunk[I2C_BUFFER_SIZE];
+      chunk[0] = address >> 8;
+      chunk[1] = address & 0xFF;
+      memcpy(chunk + 2, bytes, length);
+      while (!Twi::queue(FRAM_I2C_ADDRESS, chunk, length + 2, NULL, 0, NULL)) Twi::service(millis());
+      bytes += length;
+      address += length;
+      size -= length;
+    }
+  }
+#else
+  static bool beginFram() {
+    Wire.beginTransmission(FRAM_I2C_ADDRESS);
+    return Wire.endTransmission() == 0;
+  }
+
+  static void readFram(uint16_t address, void *data, uint8_t size) {
+    uint8_t *bytes = (uint8_t*)data;
+    while (size) {
+      uint8_t length = size < I2C_BUFFER_SIZE ? size : I2C_BUFFER_SIZE;
+      Wire.beginTransmission(FRAM_I2C_ADDRESS);
+      Wire.write(address >> 8);
+      Wire.write(address & 0xFF);
+      Wire.endTransmission(false);
+      Wire.requestFrom(FRAM_I2C_ADDRESS, length);
+      for (uint8_t i = 0; i < length; i++) bytes[i] = Wire.read();
+      bytes += length;
+      address += length;
+      size -= length;
+    }
+  }
+
+  static void writeFram(uint16_t address, const void *data, uint8_t size) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    while (size) {
+      uint8_t length = size < I2C_BUFFER_SIZE - 2 ? size : I2C_BUFFER_SIZE - 2;
+      Wire.beginTransmission(FRAM_I2C_ADDRESS);
+      Wire.write(address >> 8);
+      Wire.write(address & 0xFF);
+      for (uint8_t i = 0; i < length; i++) Wire.write(bytes[i]);
+      Wire.endTransmission();
+      bytes += length;
+      address += length;
+      size -= length;
+    }
+  }
+#endif
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_CONFIG_H
+#define PULPUTIN_CONFIG_H
+
+#include <stdint.h>
+
+// Build configuration of a unit: season, equipped subsystems and their timing.
+// The configuration is a constexpr object, so tests of it are constant and the
+// compiler drops code of the season and subsystems a unit does not have. Pins
+// are in the HAL, see ZONE_PINS of arduino_hal.h.
+
+static const uint8_t SEASON_WINTER = 0; // Heater keeps the soil from freezing, no pumping
+static const uint8_t SEASON_SUMMER = 1; // Pumping, heater still guards against frost
+static const uint8_t SEASON_AUTO = 2; // Switched by month at run time
+
+static const uint32_t ONE_SECOND = 1000;
+static const uint32_t ONE_MINUTE = 60 * ONE_SECOND;
+static const uint32_t ONE_HOUR = 60 * ONE_MINUTE;
+
+struct Config {
+  uint8_t season; // SEASON_*
+  uint8_t winterFromMonth; // SEASON_AUTO: winter from the start of this month, 1-12
+  uint8_t summerFromMonth; // ...until the start of this one
+  bool pump; // Pumps and water level sensors
+  bool heater;
+  bool motionStop; // Motion sensor holds pumping back
+  bool alarm; // Beeper and alarm events
+
+  uint32_t wetTime; // Pumping does not start this long after water level was wet, ms
+  uint32_t dryTooLongTime; // Alarm when water level has not been wet in this time, ms
+  uint32_t forceStopTime; // Button 4 holds pumping back this long, ms
+  uint32_t motionStopTime; // Pumping is held back this long after motion, ms
+
+  // False when the build never pumps, pump path is compiled out
+  constexpr bool canPump() const { return pump && season != SEASON_WINTER; }
+
+  constexpr bool isWinterMonth(uint8_t month) const {
+    return winterFromMonth <= summerFromMonth ?
+      month >= winterFromMonth && month < summerFromMonth :
+      month >= winterFromMonth || month < summerFromMonth;
+  }
+};
+
+// Constants of all units, shared by pulputin.ino and the simulation in sim/
+
+// Temperatures are in hundredths of celsius
+static const int16_t TEMP_ALARM_LOW = 300;
+static const int32_t LOW_WATER_ALARM = 7500; // ml left in container
+static const uint16_t CONTAINER_SIZE = 28000;  // Water container size in (ml)
+
+static const uint32_t HEATER_POWER = 50; // Watts
+static const uint32_t TARGET_POWER = 5; // Watts, average at full heater duty
+
+static const uint8_t MOISTURE_HYSTERESIS = 2; // Percent
+
+// Timestamp differences are valid up to ~49 days. Older timestamps are moved
+// forward to this age once a day so that they never appear recent again.
+static const uint32_t MAX_TIMESTAMP_AGE = 20 * 24 * ONE_HOUR;
+
+static const uint32_t TEMP_READ_INTERVAL = 10*ONE_SECOND;
+
+// Temperature sensor resolution in bits (9-12). Lower resolution converts faster:
+// 9 bits 0.5C / 94 ms, 10 bits 0.25C / 188 ms, 11 bits 0.125C / 375 ms, 12 bits 0.0625C / 750 ms.
+static const uint8_t TEMP_RESOLUTION = 12;
+
+// Changed fields are written back once the write-back deadline passes, a record
+// per loop iteration. Critical fields are due in the current loop iteration.
+static const uint32_t EEPROM_WRITEBACK_TIME = 5*ONE_MINUTE;
+
+// Ended statistics buckets, see StatisticsStore
+static const uint16_t EEPROM_STATISTICS_START = 192; // 828
+
+// Rest of the EEPROM holds the journal, see journal.h
+static const uint16_t EEPROM_JOURNAL_START = 1024;
+
+// Configurations of our units. Select one with UNIT_CONFIG in pulputin.ino.
+
+// Grape vine in winter: all subsystems, season fixed to winter
+static constexpr Config CONFIG_WINTER = {
+  SEASON_WINTER, 11, 4, true, true, true, true,
+  ONE_HOUR, 48 * ONE_HOUR, ONE_HOUR, 15 * ONE_MINUTE,
+};
+
+// Grape vine in summer
+static constexpr Config CONFIG_SUMMER = {
+  SEASON_SUMMER, 11, 4, true, true, true, true,
+  ONE_HOUR, 48 * ONE_HOUR, ONE_HOUR, 15 * ONE_MINUTE,
+};
+
+// Whole year in one build, winter from November to March
+static constexpr Config CONFIG_SEASONAL = {
+  SEASON_AUTO, 11, 4, true, true, true, true,
+  ONE_HOUR, 48 * ONE_HOUR, ONE_HOUR, 15 * ONE_MINUTE,
+};
+
+// Watering only, no heater or motion sensor fitted
+static constexpr Config CONFIG_PUMP_ONLY = {
+  SEASON_SUMMER, 11, 4, true, false, false, true,
+  ONE_HOUR, 48 * ONE_HOUR, ONE_HOUR, 15 * ONE_MINUTE,
+};
+
+#endif
@@ -0,0 +1,460 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_CONTROL_H
+#define PULPUTIN_CONTROL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "hal.h"
+
+// Control logic, independent of the hardware, see hal.h. Times are milliseconds
+// in the wrap-safe 32 bit timebase and are only compared through differences.
+// Update functions return what happened, persisting and reporting the change
+// is left to the caller.
+
+static const uint8_t ACTION_NONE = 0;
+static const uint8_t ACTION_STARTED = 1;
+static const uint8_t ACTION_STOPPED = 2;
+static const uint8_t ACTION_IDLE_RESTARTED = 3;
+
+// Pump is driven by PWM. Each run starts with a soft-start ramp of PUMP_RAMP_STEPS
+// equal steps up to the target duty.
+static const uint8_t PUMP_DUTY_MAX = 255;
+static const uint8_t PUMP_RAMP_STEPS = 10;
+static const uint16_t PUMP_RAMP_STEP_MS = 200;
+static const uint16_t PUMP_RAMP_MS = PUMP_RAMP_STEPS * PUMP_RAMP_STEP_MS;
+
+// Calibrated flow at evenly spaced duties, flow[i] at duty (i + 1) / PUMP_FLOW_POINTS
+// of full, interpolated in between and down to no flow at zero duty. Volume and
+// run time follow the duty the pump is actually driven at, ramp included.
+static const uint8_t PUMP_FLOW_POINTS = 4;
+static const uint32_t PUMP_FLOW_SCALE = 100000; // Flow is in ml per 100 s
+
+class PumpFlow {
+public:
+  uint16_t flow[PUMP_FLOW_POINTS]; // ml per 100 s
+
+  uint16_t flowAt(uint8_t duty) const {
+    uint16_t position = (uint16_t)duty * PUMP_FLOW_POINTS; // In PUMP_DUTY_MAX per point
+    uint8_t point = position / PUMP_DUTY_MAX;
+    if (point >= PUMP_FLOW_POINTS) return flow[PUMP_FLOW_POINTS - 1];
+    uint16_t below = point ? flow[point - 1] : 0;
+    uint16_t fraction = position - point * PUMP_DUTY_MAX;
+    return below + ((int32_t)flow[point] - below) * fraction / PUMP_DUTY_MAX;
+  }
+
+  static uint8_t rampDuty(uint8_t duty, uint32_t runMs) {
+    uint32_t step = runMs / PUMP_RAMP_STEP_MS;
+    return step >= PUMP_RAMP_STEPS ? duty : (uint16_t)duty * (step + 1) / PUMP_RAMP_STEPS;
+  }
+
+  // Millilitres pumped in runMs, rounded
+  uint32_t volumeMl(uint8_t duty, uint32_t runMs) const {
+    uint32_t scaled = 0; // ml times PUMP_FLOW_SCALE
+    for (uint8_t step = 0; step < PUMP_RAMP_STEPS && runMs; step++) {
+      uint32_t ms = runMs < PUMP_RAMP_STEP_MS ? runMs : PUMP_RAMP_STEP_MS;
+      scaled += ms * flowAt(rampDuty(duty, step * PUMP_RAMP_STEP_MS));
+      runMs -= ms;
+    }
+    uint32_t microlitres = scaled / 100 + runMs / 100 * flowAt(duty);
+    return (microlitres + 500) / 1000;
+  }
+
+  // Run time to pump ml, at most 0xFFFFFFFF without flow
+  uint32_t runTimeMs(uint8_t duty, uint16_t ml) const {
+    uint32_t left = (uint32_t)ml * PUMP_FLOW_SCALE;
+    uint32_t runMs = 0;
+    for (uint8_t step = 0; step < PUMP_RAMP_STEPS && left; step++) {
+      uint32_t stepScaled = (uint32_t)PUMP_RAMP_STEP_MS * flowAt(rampDuty(duty, runMs));
+      if (stepScaled >= left) return runMs + left / (stepScaled / PUMP_RAMP_STEP_MS);
+      left -= stepScaled;
+      runMs += PUMP_RAMP_STEP_MS;
+    }
+    uint16_t full = flowAt(duty);
+    if (!left) return runMs;
+    return full ? runMs + left / full : 0xFFFFFFFF;
+  }
+};
+
+// Pumps one portion in pumpTime and then idles for idleTime. If water level
+// has been reached during the period, next portion is skipped.
+template <class Hal>
+class PumpController {
+public:
+  uint8_t zone = 0; // Pump of the HAL driven
+  uint8_t duty = PUMP_DUTY_MAX; // After the soft-start ramp
+  uint8_t outputDuty = 0; // Currently driven
+  uint8_t rampStep = 0; // Of the soft-start ramp, PUMP_RAMP_STEPS - 1 is at full duty
+  bool running = false;
+  bool maxWaterLevel = false; // Water level has been reached during this period
+  uint32_t startedMs = 0;
+  uint32_t idleStartedMs = 0;
+  uint32_t pumpTime = 0;
+  uint32_t idleTime = 0;
+
+  void trackWaterLevel(bool waterLevel) {
+    if (waterLevel) maxWaterLevel = true;
+  }
+
+  void start(uint32_t now, bool waterLevel) {
+    running = true;
+    startedMs = now;
+    maxWaterLevel = waterLevel;
+    rampStep = 0;
+    drive(PumpFlow::rampDuty(duty, 0));
+  }
+
+  void stop(uint32_t now) {
+    running = false;
+    idleStartedMs = now;
+    drive(0);
+  }
+
+  // Duration of the latest pumping, once stopped
+  uint32_t lastRunTime() const { return idleStartedMs - startedMs; }
+
+  uint8_t update(uint32_t now, bool waterLevel, bool cantStart) {
+    if (running) {
+      if (now - startedMs > pumpTime || cantStart) {
+        stop(now);
+        return ACTION_STOPPED;
+      }
+      uint32_t step = (now - startedMs) / PUMP_RAMP_STEP_MS;
+      rampStep = step < PUMP_RAMP_STEPS ? step : PUMP_RAMP_STEPS - 1;
+      drive(PumpFlow::rampDuty(duty, now - startedMs));
+    } else if (now - idleStartedMs > idleTime) {
+      if (!maxWaterLevel && !cantStart) {
+        start(now, waterLevel);
+        return ACTION_STARTED;
+      }
+      maxWaterLevel = waterLevel;
+      idleStartedMs = now;
+      return ACTION_IDLE_RESTARTED;
+    }
+    return ACTION_NONE;
+  }
+
+  // Conditions in cantStart only become true through events that make the caller
+  // update again, so next timed event is always next ramp step, end of pumping
+  // or end of idle time.
+  uint32_t nextEvent() const {
+    if (!running) return idleStartedMs + idleTime + 1;
+    uint32_t nextStepMs = (uint32_t)(rampStep + 1) * PUMP_RAMP_STEP_MS;
+    if (rampStep < PUMP_RAMP_STEPS - 1 && nextStepMs <= pumpTime) return startedMs + nextStepMs;
+    return startedMs + pumpTime + 1;
+  }
+
+private:
+  void drive(uint8_t value) {
+    if (value == outputDuty) return;
+    outputDuty = value;
+    Hal::setPumpDuty(zone, value);
+  }
+};
+
+// Heater power follows PI control of temperature towards tempLimit. Output is
+// duty in permille, limited to maxDuty, and switched by the HAL in fixed windows.
+// Integral is frozen while the output is saturated and kept within the output
+// range (anti-windup), so a long cold spell does not cause an overshoot.
+static const uint16_t HEATER_PERMILLE = 1000;
+static const uint32_t HEATER_INTEGRAL_SCALE = 360000; // Hundredths of celsius times seconds per celsius hour
+static const uint16_t HEATER_MAX_STEP_S = 60; // Longer gaps between readings are integrated as this
+
+template <class Hal>
+class HeaterController {
+public:
+  bool running = false; // Duty is above zero
+  uint32_t startedMs = 0; // Duty rose from zero
+  uint32_t idleStartedMs = 0; // Duty fell to zero
+  int16_t tempLimit = 0; // Hundredths of celsius
+  uint16_t maxDuty = HEATER_PERMILLE; // Permille
+  uint16_t kp = 0; // Permille per celsius below tempLimit
+  uint16_t ki = 0; // Permille per celsius hour below tempLimit
+  uint16_t duty = 0; // Permille
+  int32_t integral = 0; // Permille times HEATER_INTEGRAL_SCALE
+
+  bool isTriggerTemp(int16_t temperature) const { return temperature < tempLimit; }
+
+  // Switching duty of the window, in HEATER_DUTY_MAX
+  uint8_t windowDuty() const { return (uint32_t)duty * HEATER_DUTY_MAX / HEATER_PERMILLE; }
+
+  // Called with each new temperature. Heater is off without a valid temperature.
+  uint8_t update(uint32_t now, int16_t temperature, bool valid) {
+    uint32_t stepS = updated ? (now - updatedMs) / 1000 : 0;
+    if (stepS > HEATER_MAX_STEP_S) stepS = HEATER_MAX_STEP_S;
+    updated = true;
+    updatedMs = now;
+
+    int32_t output = 0;
+    if (valid) {
+      int32_t error = (int32_t)tempLimit - temperature;
+      int32_t proportional = (int32_t)kp * error / 100;
+      output = proportional + integral / HEATER_INTEGRAL_SCALE;
+      bool saturated = (output >= maxDuty && error > 0) || (output <= 0 && error < 0);
+      if (!saturated) {
+        integral += (int32_t)ki * error * (int32_t)stepS;
+        int32_t integralMax = (int32_t)maxDuty * HEATER_INTEGRAL_SCALE;
+        if (integral > integralMax) integral = integralMax;
+        if (integral < 0) integral = 0;
+        output = proportional + integral / HEATER_INTEGRAL_SCALE;
+      }
+      if (output > maxDuty) output = maxDuty;
+      if (output < 0) output = 0;
+    } else {
+      integral = 0;
+    }
+
+    uint8_t previous = windowDuty();
+    duty = output;
+    if (windowDuty() != previous) Hal::setHeaterDuty(windowDuty());
+    if (!running && windowDuty()) {
+      running = true;
+      startedMs = now;
+      return ACTION_STARTED;
+    }
+    if (running && !windowDuty()) {
+      running = false;
+      idleStartedMs = now;
+      return ACTION_STOPPED;
+    }
+    return ACTION_NONE;
+  }
+
+private:
+  bool updated = false;
+  uint32_t updatedMs = 0;
+};
+
+struct AlarmConditions {
+  bool winter;
+  bool bootInfo; // Boot info is shown until acknowledged
+  bool tempSensorFail;
+  int16_t temperature;
+  bool dryTooLong;
+  int32_t leftWaterMl;
+  bool forceStopped;
+};
+
+class AlarmEvaluator {
+public:
+  bool running = false;
+  int16_t tempAlarmLow = 0; // Hundredths of celsius
+  int32_t lowWaterMl = 0;
+
+  // Returns true when alarm turned on or off
+  bool update(const AlarmConditions &c) {
+    bool wasRunning = running;
+    running = c.bootInfo || c.tempSensorFail || c.temperature < tempAlarmLow ||
+      (!c.winter && (c.dryTooLong || (c.leftWaterMl < lowWaterMl && !c.forceStopped)));
+    return running != wasRunning;
+  }
+};
+
+static const uint8_t STATISTICS_HOURS = 48;
+static const uint8_t STATISTICS_DAYS = 90;
+static const uint8_t STATISTICS_MONTHS = 12;
+
+// Resolutions of StatisticsStore::bucket()
+static const uint8_t STATISTICS_HOURLY = 0;
+static const uint8_t STATISTICS_DAILY = 1;
+static const uint8_t STATISTICS_MONTHLY = 2;
+
+// Returned by StatisticsStore::rollOver()
+static const uint8_t ROLLED_HOUR = 1;
+static const uint8_t ROLLED_DAY = 2;
+static const uint8_t ROLLED_MONTH = 4;
+
+struct StatisticsBucket {
+  uint32_t pumpedMl;
+  uint32_t heatedS;
+};
+
+// Water pumped and time heated per hour, day and month. Only the open buckets
+// are kept in RAM, their persistence is left to the caller. When an hour ends it
+// is written once to its slot in an EEPROM ring and added to the open day, and
+// ended days are rolled into the open month the same way. Nothing is shifted:
+// the slot of a bucket is its number modulo the ring size, so each slot is
+// written once per ring cycle.
+template <class Hal>
+class StatisticsStore {
+public:
+  // EEPROM layout from start: hours as uint16 ml and uint16 s, days as uint16 ml
+  // and uint32 s, months as uint32 ml and uint32 s
+  static const uint8_t HOUR_SIZE = 4;
+  static const uint8_t DAY_SIZE = 6;
+  static const uint8_t MONTH_SIZE = 8;
+  static const uint16_t EEPROM_SIZE = STATISTICS_HOURS * HOUR_SIZE + STATISTICS_DAYS * DAY_SIZE +
+    STATISTICS_MONTHS * MONTH_SIZE;
+
+  uint32_t hourNumber = 0; // Open hour, in hours since unix epoch
+  uint16_t dayNumber = 0; // Open day, in days since unix epoch
+  uint16_t monthNumber = 0; // Open month, year * 12 + month - 1
+  uint16_t hourPumpedMl = 0;
+  uint32_t hourHeatedMs = 0;
+  uint16_t dayPumpedMl = 0; // Ended hours of the open day
+  uint32_t dayHeatedS = 0;
+  uint32_t monthPumpedMl = 0; // Ended days of the open month
+  uint32_t monthHeatedS = 0;
+  uint16_t pumpedTotal = 0; // ml since the container was filled
+
+  explicit StatisticsStore(uint16_t start) : start(start) {}
+
+  void addPumped(uint16_t ml) {
+    hourPumpedMl += ml;
+    pumpedTotal += ml;
+  }
+
+  void addHeated(uint32_t ms) { hourHeatedMs += ms; }
+
+  // Close open buckets that have ended. Buckets skipped while powered off are
+  // cleared. Returns ROLLED_* bits of the resolutions that rolled over.
+  uint8_t rollOver(uint32_t hour, uint16_t day, uint16_t month) {
+    uint8_t rolled = 0;
+    if ((int32_t)(hour - hourNumber) > 0) {
+      uint16_t heatedS = hourHeatedSeconds();
+      writeHour(hourNumber, hourPumpedMl, heatedS);
+      dayPumpedMl += hourPumpedMl;
+      dayHeatedS += heatedS;
+      uint32_t skipped = hour - hourNumber > STATISTICS_HOURS ? hour - STATISTICS_HOURS : hourNumber + 1;
+      for (; skipped != hour; skipped++) writeHour(skipped, 0, 0);
+      hourNumber = hour;
+      hourPumpedMl = 0;
+      hourHeatedMs = 0;
+      rolled |= ROLLED_HOUR;
+    }
+    if ((int16_t)(day - dayNumber) > 0) {
+      writeDay(dayNumber, dayPumpedMl, dayHeatedS);
+      monthPumpedMl += dayPumpedMl;
+      monthHeatedS += dayHeatedS;
+      uint16_t skipped = (uint16_t)(day - dayNumber) > STATISTICS_DAYS ? day - STATISTICS_DAYS : dayNumber + 1;
+      for (; skipped != day; skipped++) writeDay(skipped, 0, 0);
+      dayNumber = day;
+      dayPumpedMl = 0;
+      dayHeatedS = 0;
+      rolled |= ROLLED_DAY;
+    }
+    if ((int16_t)(month - monthNumber) > 0) {
+      writeMonth(monthNumber, monthPumpedMl, monthHeatedS);
+      uint16_t skipped = (uint16_t)(month - monthNumber) > STATISTICS_MONTHS ? month - STATISTICS_MONTHS : monthNumber + 1;
+      for (; skipped != month; skipped++) writeMonth(skipped, 0, 0);
+      monthNumber = month;
+      monthPumpedMl = 0;
+      monthHeatedS = 0;
+      rolled |= ROLLED_MONTH;
+    }
+    return rolled;
+  }
+
+  // Number of buckets of a resolution, open bucket included
+  static uint8_t bucketCount(uint8_t resolution) {
+    return 1 + (resolution == STATISTICS_HOURLY ? STATISTICS_HOURS :
+      resolution == STATISTICS_DAILY ? STATISTICS_DAYS : STATISTICS_MONTHS);
+  }
+
+  // Bucket that ended ago hours, days or months before the open one. Open
+  // bucket, ago 0, includes what has been added so far.
+  StatisticsBucket bucket(uint8_t resolution, uint8_t ago) const {
+    StatisticsBucket result = {0, 0};
+    if (ago >= bucketCount(resolution)) return result;
+    if (resolution == STATISTICS_HOURLY) {
+      if (!ago) {
+        result.pumpedMl = hourPumpedMl;
+        result.heatedS = hourHeatedSeconds();
+        return result;
+      }
+      uint16_t hour[2];
+      Hal::readEeprom(hourAddress(hourNumber - ago), hour, HOUR_SIZE);
+      result.pumpedMl = hour[0];
+      result.heatedS = hour[1];
+    } else if (resolution == STATISTICS_DAILY) {
+      if (!ago) {
+        result = bucket(STATISTICS_HOURLY, 0);
+        result.pumpedMl += dayPumpedMl;
+        result.heatedS += dayHeatedS;
+        return result;
+      }
+      uint16_t pumped;
+      uint16_t address = dayAddress(dayNumber - ago);
+      Hal::readEeprom(address, &pumped, sizeof(pumped));
+      Hal::readEeprom(address + sizeof(pumped), &result.heatedS, sizeof(result.heatedS));
+      result.pumpedMl = pumped;
+    } else {
+      if (!ago) {
+        result = bucket(STATISTICS_DAILY, 0);
+        result.pumpedMl += monthPumpedMl;
+        result.heatedS += monthHeatedS;
+        return result;
+      }
+      Hal::readEeprom(monthAddress(monthNumber - ago), &result, MONTH_SIZE);
+    }
+    return result;
+  }
+
+  StatisticsBucket day(uint8_t ago) const { return bucket(STATISTICS_DAILY, ago); }
+
+  // Set an ended day, for migrating older daily statistics
+  void importDay(uint8_t ago, uint16_t pumpedMl, uint32_t heatedS) {
+    if (ago > STATISTICS_DAYS) return;
+    if (ago) {
+      writeDay(dayNumber - ago, pumpedMl, heatedS);
+    } else {
+      dayPumpedMl = pumpedMl;
+      dayHeatedS = heatedS;
+    }
+  }
+
+  // Clear all buckets, open buckets start from the given hour, day and month
+  void clear(uint32_t hour, uint16_t day, uint16_t month) {
+    for (uint8_t i = 0; i < STATISTICS_HOURS; i++) writeHour(i, 0, 0);
+    for (uint8_t i = 0; i < STATISTICS_DAYS; i++) writeDay(i, 0, 0);
+    for (uint8_t i = 0; i < STATISTICS_MONTHS; i++) writeMonth(i, 0, 0);
+    hourNumber = hour;
+    dayNumber = day;
+    monthNumber = month;
+    hourPumpedMl = 0;
+    hourHeatedMs = 0;
+    dayPumpedMl = 0;
+    dayHeatedS = 0;
+    monthPumpedMl = 0;
+    monthHeatedS = 0;
+  }
+
+private:
+  uint16_t start;
+
+  uint16_t hourHeatedSeconds() const {
+    uint32_t seconds = (hourHeatedMs + 500) / 1000;
+    return seconds > 0xFFFF ? 0xFFFF : seconds;
+  }
+
+  uint16_t hourAddress(uint32_t hour) const { return start + hour % STATISTICS_HOURS * HOUR_SIZE; }
+  uint16_t dayAddress(uint16_t day) const {
+    return start + STATISTICS_HOURS * HOUR_SIZE + day % STATISTICS_DAYS * DAY_SIZE;
+  }
+  uint16_t monthAddress(uint16_t month) const {
+    return start + STATISTICS_HOURS * HOUR_SIZE + STATISTICS_DAYS * DAY_SIZE + month % STATISTICS_MONTHS * MONTH_SIZE;
+  }
+
+  void writeHour(uint32_t hour, uint16_t pumpedMl, uint16_t heatedS) {
+    uint16_t data[2] = {pumpedMl, heatedS};
+    Hal::writeEeprom(hourAddress(hour), data, HOUR_SIZE);
+    Hal::resetWatchdog();
+  }
+
+  void writeDay(uint16_t day, uint16_t pumpedMl, uint32_t heatedS) {
+    uint8_t data[DAY_SIZE];
+    memcpy(data, &pumpedMl, sizeof(pumpedMl));
+    memcpy(data + sizeof(pumpedMl), &heatedS, sizeof(heatedS));
+    Hal::writeEeprom(dayAddress(day), data, DAY_SIZE);
+    Hal::resetWatchdog();
+  }
+
+  void writeMonth(uint16_t month, uint32_t pumpedMl, uint32_t heatedS) {
+    uint32_t data[2] = {pumpedMl, heatedS};
+    Hal::writeEeprom(monthAddress(month), data, MONTH_SIZE);
+    Hal::resetWatchdog();
+  }
+};
+
+#endif
@@ -0,0 +1,147 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_DS3231_H
+#define PULPUTIN_DS3231_H
+
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+#include "twi_queue.h"
+
+// DS3231 RTC on the TWI queue, replacing RTClib with USE_ASYNC_I2C. DateTime
+// has the part of the RTClib interface the sketch uses. Dates are from 2000
+// on, in 24 hour time.
+
+static const uint8_t DS3231_I2C_ADDRESS = 0x68;
+static const uint8_t DS3231_TIME_REGISTER = 0x00; // Seconds to year, 7 registers in BCD
+static const uint8_t DS3231_CONTROL_REGISTER = 0x0E;
+static const uint8_t DS3231_STATUS_REGISTER = 0x0F;
+static const uint8_t DS3231_OSF = 0x80; // Oscillator has stopped, time is not valid
+static const uint8_t DS3231_TIME_SIZE = 7;
+
+class DateTime {
+public:
+  DateTime(uint32_t unixTime = 0) { setunixtime(unixTime); }
+
+  // From __DATE__ and __TIME__, like "Oct 14 2026" and "12:34:56"
+  DateTime(const char *date, const char *time) {
+    static const char MONTHS[] PROGMEM = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    uint8_t m = 1;
+    while (m < 12 && strncmp_P(date, MONTHS + (m - 1) * 3, 3)) m++;
+    set(atoi(date + 7), m, atoi(date + 4), atoi(time), atoi(time + 3), atoi(time + 6));
+  }
+
+  DateTime(uint16_t y, uint8_t m, uint8_t d, uint8_t hh, uint8_t mm, uint8_t ss) { set(y, m, d, hh, mm, ss); }
+
+  uint16_t year() const { return y; }
+  uint8_t month() const { return m; }
+  uint8_t day() const { return d; }
+  uint8_t hour() const { return hh; }
+  uint8_t minute() const { return mm; }
+  uint8_t second() const { return ss; }
+  uint32_t unixtime() const { return t; }
+
+  void setunixtime(uint32_t unixTime) {
+    t = unixTime;
+    ss = unixTime % 60;
+    mm = unixTime / 60 % 60;
+    hh = unixTime / 3600 % 24;
+    // Civil date from days since 1970-01-01, by Howard Hinnant
+    uint32_t z = unixTime / 86400 + 719468UL;
+    uint32_t era = z / 146097UL;
+    uint32_t doe = z - era * 146097UL;
+    uint16_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint16_t doy = doe - (365UL * yoe + yoe / 4 - yoe / 100);
+    uint8_t mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = era * 400 + yoe + (m <= 2);
+  }
+
+  // YYYY-MM-DD hh:mm:ss, 20 bytes with the terminator
+  void tostr(char *buf) const {
+    snprintf_P(buf, 20, PSTR("%04u-%02u-%02u %02u:%02u:%02u"), y, m, d, hh, mm, ss);
+  }
+
+private:
+  uint32_t t;
+  uint16_t y;
+  uint8_t m, d, hh, mm, ss;
+
+  void set(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second) {
+    // Days since 1970-01-01 of a civil date
+    uint16_t yy = year - (month <= 2);
+    uint32_t era = yy / 400;
+    uint16_t yoe = yy - era * 400;
+    uint16_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t days = era * 146097UL + 365UL * yoe + yoe / 4 - yoe / 100 + doy - 719468UL;
+    setunixtime(days * 86400UL + hour * 3600UL + minute * 60UL + second);
+  }
+};
+
+struct Ds3231 {
+  // Blocking, for boot. False if the oscillator has stopped and time is not valid.
+  static bool isRunning() {
+    uint8_t reg = DS3231_STATUS_REGISTER;
+    uint8_t status = DS3231_OSF;
+    Twi::run(DS3231_I2C_ADDRESS, &reg, 1, &status, 1);
+    return !(status & DS3231_OSF);
+  }
+
+  // Blocking. Clears the oscillator stop flag.
+  static void adjust(const DateTime &time) {
+    uint8_t bytes[] = {
+      DS3231_TIME_REGISTER, toBcd(time.second()), toBcd(time.minute()), toBcd(time.hour()), 1,
+      toBcd(time.day()), toBcd(time.month()), toBcd(time.year() - 2000),
+    };
+    Twi::run(DS3231_I2C_ADDRESS, bytes, sizeof(bytes), NULL, 0);
+    uint8_t status[] = {DS3231_STATUS_REGISTER, 0};
+    Twi::run(DS3231_I2C_ADDRESS, status, sizeof(status), NULL, 0);
+  }
+
+  // Blocking
+  static uint32_t now() {
+    uint8_t reg = DS3231_TIME_REGISTER;
+    Twi::run(DS3231_I2C_ADDRESS, &reg, 1, registers, DS3231_TIME_SIZE);
+    return toUnixTime();
+  }
+
+  // Queue a read of the time, see ready()
+  static void request() {
+    uint8_t reg = DS3231_TIME_REGISTER;
+    state = TWI_PENDING;
+    if (!Twi::queue(DS3231_I2C_ADDRESS, &reg, 1, registers, DS3231_TIME_SIZE, onRead)) state = TWI_BUS_ERROR;
+  }
+
+  // True when the time requested has been read
+  static bool ready(uint32_t &unixTime) {
+    if (state != TWI_OK) return false;
+    unixTime = toUnixTime();
+    return true;
+  }
+
+  // Blocking. 1 Hz square wave on SQW instead of the alarm interrupt.
+  static void enableSquareWave() {
+    uint8_t bytes[] = {DS3231_CONTROL_REGISTER, 0x00};
+    Twi::run(DS3231_I2C_ADDRESS, bytes, sizeof(bytes), NULL, 0);
+  }
+
+private:
+  static uint8_t registers[DS3231_TIME_SIZE];
+  static volatile uint8_t state; // TWI_* of the latest request
+
+  static void onRead(uint8_t status) { state = status; }
+
+  static uint8_t toBcd(uint8_t value) { return value / 10 << 4 | value % 10; }
+  static uint8_t fromBcd(uint8_t value) { return (value >> 4) * 10 + (value & 0x0F); }
+
+  static uint32_t toUnixTime() {
+    return DateTime(2000 + fromBcd(registers[6]), fromBcd(registers[5] & 0x1F), fromBcd(registers[4]),
+      fromBcd(registers[2] & 0x3F), fromBcd(registers[1]), fromBcd(registers[0] & 0x7F)).unixtime();
+  }
+};
+
+uint8_t Ds3231::registers[DS3231_TIME_SIZE];
+volatile uint8_t Ds3231::state = TWI_PENDING;
+
+#endif
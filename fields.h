@@ -0,0 +1,64 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_FIELDS_H
+#define PULPUTIN_FIELDS_H
+
+#include <stdint.h>
+
+// Persisted fields, see journal.h. Numbers are stored in EEPROM, so existing
+// fields must not be renumbered.
+static const uint8_t FIELD_PUMP_TOTAL = 0;
+static const uint8_t FIELD_PUMP_STARTED = 1;
+static const uint8_t FIELD_IDLE_STARTED = 2;
+static const uint8_t FIELD_HEATER_STARTED = 3;
+static const uint8_t FIELD_LAST_WET = 4;
+static const uint8_t FIELD_DISPLAY_MODE = 5;
+static const uint8_t FIELD_TEMP_LIMIT = 6;
+static const uint8_t FIELD_PUMP_PORTION = 7;
+static const uint8_t FIELD_PERIOD_TIME = 8;
+// Open buckets of StatisticsStore, ended buckets have their own EEPROM area
+static const uint8_t FIELD_HOUR_NUMBER = 9;
+static const uint8_t FIELD_DAY_NUMBER = 10;
+static const uint8_t FIELD_MONTH_NUMBER = 11;
+static const uint8_t FIELD_HOUR_PUMPED = 12;
+static const uint8_t FIELD_HOUR_HEATED = 13;
+static const uint8_t FIELD_DAY_PUMPED = 14;
+static const uint8_t FIELD_DAY_HEATED = 15;
+static const uint8_t FIELD_MONTH_PUMPED = 16;
+static const uint8_t FIELD_MONTH_HEATED = 17;
+static const uint8_t FIELD_LOG_INTERVAL = 18;
+static const uint8_t FIELD_MOISTURE_LIMIT = 19;
+// Zones 1-3 of a multi-zone board, zone 0 keeps the fields of a single pot
+static const uint8_t FIELD_ZONE_PUMP_STARTED = 20;
+static const uint8_t FIELD_ZONE_IDLE_STARTED = 23;
+static const uint8_t FIELD_ZONE_LAST_WET = 26;
+static const uint8_t FIELD_ZONE_PUMPED_TODAY = 29; // Zones 0-3
+static const uint8_t FIELD_TEMP_SENSOR_ROM = 33; // 3 probes, ROM code in two halves each
+static const uint8_t FIELD_HEATER_SENSOR = 39;
+static const uint8_t FIELD_HEATER_KP = 40;
+static const uint8_t FIELD_HEATER_KI = 41;
+static const uint8_t FIELD_PUMP_DUTY = 42;
+static const uint8_t FIELD_PUMP_FLOW = 43; // 4 calibration points
+// Latest reset other than power on, see ResetRecord of pulputin.ino
+static const uint8_t FIELD_LAST_RESET = 47; // Cause, stage, outputs and watchdog reset count
+static const uint8_t FIELD_RESET_LOOP = 48;
+static const uint8_t FIELD_RESET_TIME = 49;
+static const uint8_t FIELD_COUNT = 50;
+
+inline uint8_t pumpStartedField(uint8_t zone) { return zone ? FIELD_ZONE_PUMP_STARTED + zone - 1 : FIELD_PUMP_STARTED; }
+inline uint8_t idleStartedField(uint8_t zone) { return zone ? FIELD_ZONE_IDLE_STARTED + zone - 1 : FIELD_IDLE_STARTED; }
+inline uint8_t lastWetField(uint8_t zone) { return zone ? FIELD_ZONE_LAST_WET + zone - 1 : FIELD_LAST_WET; }
+
+// Critical fields are written at once, others after a write-back delay. Hour,
+// day and month numbers of the open buckets are not critical: they roll over
+// every hour and must be written with the bucket sums, so that a reset never
+// pairs a new number with the sums of the bucket that ended.
+inline bool isCriticalField(uint8_t field) {
+  return field == FIELD_PUMP_STARTED || field == FIELD_PUMP_TOTAL ||
+    (field >= FIELD_ZONE_PUMP_STARTED && field < FIELD_ZONE_IDLE_STARTED) ||
+    (field >= FIELD_TEMP_LIMIT && field <= FIELD_PERIOD_TIME) ||
+    (field >= FIELD_LOG_INTERVAL && field <= FIELD_MOISTURE_LIMIT) || (field >= FIELD_HEATER_SENSOR && field < FIELD_COUNT);
+}
+
+#endif
@@ -0,0 +1,85 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_HAL_H
+#define PULPUTIN_HAL_H
+
+#include <stdint.h>
+
+// Hardware abstraction. Control logic takes the HAL as a template parameter,
+// so that hardware access is resolved at compile time and inlined, without
+// virtual calls. A HAL is a class with these static functions:
+//
+//   void begin()                          Configure pins, outputs off
+//   uint16_t readInputs()                 INPUT_* bits of buttons and sensors
+//   uint16_t readMoisture(uint8_t zone)   Filtered moisture sensor value, full scale is 65535
+//   void resumeAfterSleep(uint16_t sleptMs)  Restart peripherals stopped by power down
+//   void setPumpDuty(uint8_t zone, uint8_t duty)  PWM duty of the pump, 0 is off, 255 full
+//   void setHeaterDuty(uint8_t duty)      On ticks per switching window, of HEATER_DUTY_MAX. Takes
+//                                         effect from the next window, full on and off at once
+//   uint32_t readHeaterOnMs()             Heater on time since begin(), wraps around
+//   uint32_t heaterOffMs()                Time the heater output stays off, 0 while it is on and
+//                                         0xFFFFFFFF with zero duty. Power down is allowed this long.
+//   void setLed(bool on)
+//   void setBeeper(uint8_t duty)          PWM duty, 0 is off
+//   uint16_t beginTemperature(uint8_t resolution)  Returns conversion time in ms
+//   bool findTemperatureSensor(uint8_t index, SensorAddress &address)  Bus search, slow
+//   void requestTemperature()             Start conversion on all sensors, does not block
+//   int32_t readTemperatureRaw(const SensorAddress &address)  In 1/128 celsius or
+//                                         TEMP_RAW_DISCONNECTED
+//   void beginI2c()                       Before the RTC, display and FRAM
+//   void serviceBus()                     Called every loop iteration, recovers a stuck bus
+//   bool isBusIdle()                      No I2C transfers pending, power down allowed
+//   bool beginRtc()                       Returns false if RTC was not running
+//   uint32_t readRtc()                    Unix time in seconds, blocks
+//   void requestRtc()                     Start reading the time, see rtcReady()
+//   bool rtcReady(uint32_t &unixTime)     True when the requested time has been read
+//   void enableRtcSquareWave()            1 Hz on SQW
+//   void beginLcd()
+//   bool setLcdCursor(uint8_t col, uint8_t row)  Queued, false if the queue is full
+//   bool writeLcd(char c)                 Likewise
+//   void setLcdBacklight(bool on)
+//   void readEeprom(uint16_t address, void *data, uint8_t size)
+//   void writeEeprom(uint16_t address, const void *data, uint8_t size)
+//   void updateEepromByte(uint16_t address, uint8_t value)
+//   void resetWatchdog()                  Called between slow operations
+//   bool beginFram()                      Returns false if there is no FRAM
+//   void readFram(uint16_t address, void *data, uint8_t size)
+//   void writeFram(uint16_t address, const void *data, uint8_t size)
+//
+// ArduinoHal in arduino_hal.h implements these for the Mega board. Header of
+// the HAL also defines ZONE_COUNT, number of pots watered, at most MAX_ZONES.
+
+// Inputs are sampled once per loop iteration into a bitmask. Buttons are active low,
+// bits are set when button is pressed.
+static const uint16_t INPUT_BUTTON1 = 1 << 0;
+static const uint16_t INPUT_BUTTON2 = 1 << 1;
+static const uint16_t INPUT_BUTTON3 = 1 << 2;
+static const uint16_t INPUT_BUTTON4 = 1 << 3;
+static const uint16_t INPUT_BUTTON5 = 1 << 4;
+static const uint16_t INPUT_BUTTON6 = 1 << 5;
+static const uint16_t INPUT_BUTTON7 = 1 << 6;
+static const uint16_t INPUT_BUTTON8 = 1 << 7;
+static const uint16_t INPUT_WATER_LEVEL = 1 << 8;
+static const uint16_t INPUT_MOTION = 1 << 9;
+
+// Each zone has its own pump, water level sensor and moisture sensor. Water level
+// of zone 0 is INPUT_WATER_LEVEL, other zones follow INPUT_MOTION.
+static const uint8_t MAX_ZONES = 4;
+
+inline uint16_t inputWaterLevel(uint8_t zone) { return zone ? 1 << (9 + zone) : INPUT_WATER_LEVEL; }
+static const uint8_t INPUT_BITS = 9 + MAX_ZONES; // Up to water level of the last zone
+
+static const int32_t TEMP_RAW_DISCONNECTED = -7040;
+
+// Heater is switched by a timer in fixed windows, independent of loop latency
+static const uint8_t HEATER_DUTY_MAX = 200; // Ticks per window
+static const uint16_t HEATER_TICK_MS = 100;
+static const uint32_t HEATER_WINDOW_MS = (uint32_t)HEATER_DUTY_MAX * HEATER_TICK_MS;
+
+// ROM code of a 1-Wire temperature sensor, all zero for none
+struct SensorAddress {
+  uint8_t rom[8];
+};
+
+#endif
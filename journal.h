@@ -0,0 +1,191 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_JOURNAL_H
+#define PULPUTIN_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Persisted state is stored in a journal: a ring of small append-only records
+// spread over an EEPROM area. Each record holds one field. Newest record
+// of each field wins when the journal is replayed at boot.
+//
+// Changed fields are marked dirty and written later by flush(), one at a time.
+
+static const uint8_t JOURNAL_DATA_SIZE = 4;
+static const uint8_t JOURNAL_RECORD_SIZE = 4 + JOURNAL_DATA_SIZE;
+static const uint16_t JOURNAL_NO_SLOT = 0xFFFF;
+
+struct JournalRecord {
+  uint16_t seq;
+  uint8_t field;
+  uint8_t checksum;
+  uint8_t data[JOURNAL_DATA_SIZE];
+};
+
+// Hal provides EEPROM access and watchdog reset, see hal.h. Field data is
+// located through fieldData, which returns address and size of a field value.
+template <class Hal, uint8_t FieldCount>
+class Journal {
+public:
+  typedef void *(*FieldData)(uint8_t field, uint8_t &size);
+
+  uint16_t slots[FieldCount]; // Slot of the latest record of each field
+  uint16_t head = 0; // Next slot to be written
+  uint16_t seq = 0;
+  uint8_t dirty[(FieldCount + 7) / 8];
+
+  Journal(uint16_t start, uint16_t end, FieldData fieldData) :
+    start(start), slotCount((end - start) / JOURNAL_RECORD_SIZE), fieldData(fieldData) {}
+
+  uint16_t address(uint16_t slot) const { return start + slot * JOURNAL_RECORD_SIZE; }
+
+  static uint8_t checksum(const JournalRecord &rec) {
+    const uint8_t *bytes = (const uint8_t*)&rec;
+    uint8_t sum = 0x5A;
+    for (uint8_t i = 0; i < sizeof(rec); i++) {
+      if (bytes + i != &rec.checksum) sum += bytes[i];
+    }
+    return sum;
+  }
+
+  bool readRecord(uint16_t slot, JournalRecord &rec) const {
+    Hal::readEeprom(address(slot), &rec, sizeof(rec));
+    return rec.field < FieldCount && rec.checksum == checksum(rec);
+  }
+
+  // Append current value of a field to the journal. The slot at head never holds
+  // the latest record of a field, so a write only replaces an outdated record.
+  // A field whose latest record is in the slot after head is first carried
+  // forward into head (compaction), so that no field is lost even if power
+  // fails between the writes.
+  void write(uint8_t field) {
+    while (carryForward(field)) {}
+    appendValue(field);
+  }
+
+  // Value of a field differs from its latest record
+  bool changed(uint8_t field) const {
+    uint16_t slot = slots[field];
+    if (slot == JOURNAL_NO_SLOT) return true;
+    uint8_t size;
+    const void *value = fieldData(field, size);
+    uint8_t stored[JOURNAL_DATA_SIZE];
+    Hal::readEeprom(address(slot) + offsetof(JournalRecord, data), stored, size);
+    return memcmp(stored, value, size);
+  }
+
+  // Find newest record and replay the whole ring from the oldest record onwards
+  void mount() {
+    JournalRecord rec;
+    bool found = false;
+    uint16_t newest = 0;
+    uint16_t newestSeq = 0;
+    for (uint16_t slot = 0; slot < slotCount; slot++) {
+      if (readRecord(slot, rec) && (!found || (int16_t)(rec.seq - newestSeq) > 0)) {
+        found = true;
+        newest = slot;
+        newestSeq = rec.seq;
+      }
+    }
+    for (uint8_t field = 0; field < FieldCount; field++) {
+      slots[field] = JOURNAL_NO_SLOT;
+    }
+    head = found ? (newest + 1) % slotCount : 0;
+    seq = newestSeq + 1;
+
+    for (uint16_t i = 0; i < slotCount; i++) {
+      uint16_t slot = (head + i) % slotCount;
+      if (!readRecord(slot, rec)) continue;
+      uint8_t size;
+      void *value = fieldData(rec.field, size);
+      if (value) memcpy(value, rec.data, size);
+      slots[rec.field] = slot;
+    }
+  }
+
+  // Invalidate all records and write every field from scratch
+  void format() {
+    JournalRecord rec;
+    for (uint16_t slot = 0; slot < slotCount; slot++) {
+      if (readRecord(slot, rec)) {
+        Hal::updateEepromByte(address(slot) + offsetof(JournalRecord, field), 0xFF);
+        Hal::resetWatchdog();
+      }
+    }
+    for (uint8_t field = 0; field < FieldCount; field++) {
+      slots[field] = JOURNAL_NO_SLOT;
+    }
+    head = 0;
+    seq = 0;
+    for (uint8_t field = 0; field < FieldCount; field++) {
+      uint8_t size;
+      if (fieldData(field, size)) write(field); // Fields of zones not wired have no data
+    }
+    memset(dirty, 0, sizeof(dirty));
+    flushNext = 0;
+  }
+
+  void markDirty(uint8_t field) { dirty[field / 8] |= 1 << (field % 8); }
+  bool isDirty(uint8_t field) const { return dirty[field / 8] & 1 << (field % 8); }
+
+  // Write at most one record: the next dirty field that has changed, or a record
+  // carried forward to make room for it. EEPROM writes block, so a flush is
+  // spread over calls. Fields are gone through in turn, a field changing all
+  // the time does not hold back the others. Returns true at the end of a round,
+  // fields that changed during it are left dirty for the next one.
+  bool flush() {
+    for (; flushNext < FieldCount; flushNext++) {
+      uint8_t field = flushNext;
+      if (!isDirty(field)) continue;
+      bool outdated = changed(field);
+      if (outdated && carryForward(field)) return false;
+      dirty[field / 8] &= ~(1 << (field % 8));
+      if (!outdated) continue;
+      appendValue(field);
+      flushNext++;
+      return false;
+    }
+    flushNext = 0;
+    return true;
+  }
+
+private:
+  uint16_t start;
+  uint16_t slotCount;
+  FieldData fieldData;
+  uint8_t flushNext = 0; // Field flush() continues from
+
+  // Carry forward a record of another field in the slot after head. Returns
+  // false when that slot is free for field.
+  bool carryForward(uint8_t field) {
+    uint16_t next = (head + 1) % slotCount;
+    JournalRecord old;
+    if (!readRecord(next, old) || slots[old.field] != next || old.field == field) return false;
+    append(old);
+    return true;
+  }
+
+  void appendValue(uint8_t field) {
+    JournalRecord rec;
+    uint8_t size;
+    const void *value = fieldData(field, size);
+    memset(rec.data, 0, JOURNAL_DATA_SIZE);
+    memcpy(rec.data, value, size);
+    rec.field = field;
+    append(rec);
+  }
+
+  void append(JournalRecord &rec) {
+    rec.seq = seq++;
+    rec.checksum = checksum(rec);
+    Hal::writeEeprom(address(head), &rec, sizeof(rec));
+    Hal::resetWatchdog();
+    slots[rec.field] = head;
+    head = (head + 1) % slotCount;
+  }
+};
+
+#endif
@@ -0,0 +1,76 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_LCD_I2C_H
+#define PULPUTIN_LCD_I2C_H
+
+#include <Arduino.h>
+#include "twi_queue.h"
+
+// HD44780 character display behind a PCF8574 I2C backpack, in 4 bit mode,
+// written through the TWI queue. A character is four bytes to the expander:
+// each nibble is set up with EN high and latched by EN falling. Writes of a
+// refresh are appended into one transaction, see Twi::append().
+
+static const uint8_t LCD_RS = 0x01; // Expander bits
+static const uint8_t LCD_EN = 0x04;
+static const uint8_t LCD_BACKLIGHT = 0x08;
+
+static const uint8_t LCD_CLEAR = 0x01;
+static const uint8_t LCD_ENTRY_LEFT = 0x06;
+static const uint8_t LCD_DISPLAY_ON = 0x0C;
+static const uint8_t LCD_FUNCTION_4BIT_2LINE = 0x28;
+static const uint8_t LCD_SET_DDRAM = 0x80;
+
+struct LcdI2c {
+  static uint8_t address;
+  static uint8_t backlight;
+
+  // Blocking, called once at boot. Expander may be in any state, so the
+  // display is first set to 8 bit mode and then to 4 bit mode.
+  static void begin(uint8_t i2cAddress) {
+    address = i2cAddress;
+    backlight = LCD_BACKLIGHT;
+    delay(50); // Power up of the display
+    for (uint8_t i = 0; i < 3; i++) {
+      writeNibble(0x30);
+      delay(5);
+    }
+    writeNibble(0x20);
+    command(LCD_FUNCTION_4BIT_2LINE);
+    command(LCD_DISPLAY_ON);
+    command(LCD_ENTRY_LEFT);
+    // Clear takes 1.5 ms, the display ignores commands until it is done
+    command(LCD_CLEAR);
+    while (!Twi::idle()) Twi::service(millis());
+    delay(2);
+  }
+
+  static bool setCursor(uint8_t col, uint8_t row) { return command(LCD_SET_DDRAM | (col + (row ? 0x40 : 0))); }
+  static bool write(char c) { return send(c, LCD_RS); }
+
+  static void setBacklight(bool on) {
+    backlight = on ? LCD_BACKLIGHT : 0;
+    Twi::append(address, &backlight, 1);
+  }
+
+private:
+  static bool command(uint8_t value) { return send(value, 0); }
+
+  static bool send(uint8_t value, uint8_t mode) {
+    uint8_t high = (value & 0xF0) | mode | backlight;
+    uint8_t low = (value << 4) | mode | backlight;
+    uint8_t bytes[] = {(uint8_t)(high | LCD_EN), high, (uint8_t)(low | LCD_EN), low};
+    return Twi::append(address, bytes, sizeof(bytes));
+  }
+
+  static void writeNibble(uint8_t nibble) {
+    uint8_t bytes[] = {(uint8_t)(nibble | backlight | LCD_EN), (uint8_t)(nibble | backlight)};
+    Twi::run(address, bytes, sizeof(bytes), NULL, 0);
+  }
+};
+
+uint8_t LcdI2c::address = 0;
+uint8_t LcdI2c::backlight = LCD_BACKLIGHT;
+
+#endif
@@ -2,63 +2,55 @@
 // License: GPL. See GPL.txt for more info
 
 // #define USE_LOWPOWER
+// #define USE_RTC_SQW // DS3231 SQW output wired to RTC_SQW_PIN is used as timebase
+// #define USE_SENSOR_LOG // Sensor history in FRAM at FRAM_I2C_ADDRESS, see sensor_log.h
+// #define UNIT_CONFIG CONFIG_SEASONAL // Season and subsystems of the unit, see config.h. CONFIG_WINTER by default
+// #define USE_PIN_WAKE // With USE_LOWPOWER, buttons 1-6 on A8-A13 and pin change interrupts wake from power down
+// #define USE_ASYNC_I2C // Interrupt driven I2C queue instead of Wire for LCD, RTC and FRAM, see twi_queue.h
+// #define USE_UPLINK // Batched telemetry to a Wi-Fi or LoRa coprocessor on UPLINK_SERIAL, see uplink.h
 
-#include <LiquidCrystal_I2C.h>
 #include <EEPROM.h>
-#include <RTClib.h>
-#include <OneWire.h>
-#include <DallasTemperature.h>
 #include <avr/wdt.h>
 #ifdef USE_LOWPOWER
   #include <LowPower.h>
+  #include <avr/sleep.h>
+#endif
+#include "arduino_hal.h"
+#include "config.h"
+#include "control.h"
+#include "fields.h"
+#include "journal.h"
+#ifdef USE_SENSOR_LOG
+  #include "sensor_log.h"
+#endif
+#ifdef USE_UPLINK
+  #include "uplink.h"
 #endif
 
-static const uint16_t ONE_WIRE_PIN = 30; // Temperature sensor
-static const uint16_t OUT_HEATER_PIN = 34;
-
-static const uint16_t BUTTON1_PIN = 39;
-static const uint16_t BUTTON2_PIN = 41;
-static const uint16_t BUTTON3_PIN = 43;
-static const uint16_t BUTTON4_PIN = 45;
-static const uint16_t BUTTON5_PIN = 47;
-static const uint16_t BUTTON6_PIN = 49;
-static const uint16_t BUTTON7_PIN = 51;
-static const uint16_t BUTTON8_PIN = 53;
-
-static const uint16_t WATER_LEVEL_PIN = 48;
-
-static const uint16_t IN_MOISTURE1_PIN = A0;
-
-static const uint16_t OUT_PUMP_PIN = 4; // PWM possible
-static const uint16_t ALARM_PIN = 3;
+// Hardware access of the control logic, see hal.h
+typedef ArduinoHal Hal;
 
-static const uint16_t MOTION_PIN = 52;
-static const uint16_t MOTION_GROUND_PIN = 50;
+#ifndef UNIT_CONFIG
+  #define UNIT_CONFIG CONFIG_WINTER
+#endif
+static constexpr Config CONFIG = UNIT_CONFIG;
 
-uint16_t moisture1Percent = 0;
-bool waterLevel = false;
-bool maxWaterLevel = false; 
-bool motionSns = false;
-bool alarmRunning = false;
+#include "unit.h"
 
+static const uint8_t DEBOUNCE_TIME = 30; // ms
 
-// How many ml water has been pumped each hour
-// Latest is first item.
-// Once an hour last item is removed and each item is moved one forward.
-uint16_t pumpStatistics[24]; 
-uint16_t pumpedTotal = 0;
+uint16_t rawInputs = 0;
+uint16_t inputs = 0; // Debounced
+uint16_t inputsPressed = 0; // Became active during this loop iteration
+uint16_t inputsReleased = 0; // Became inactive during this loop iteration
+uint16_t rawInputChangedMs[INPUT_BITS]; // Low half of timeNow, per input
 
-// How many milliseconds has been spent to heat, each hour.
-uint32_t heatStatistics[24]; 
+bool backlightOn = false;
 
-// EEPROM addresses
+// Legacy fixed EEPROM layout. Only read once to migrate a unit to the journal.
 static const uint16_t EEPROM_PUMP_STATISTICS = 0; // 2*24 = 48
 static const uint16_t EEPROM_CONFIGURED = 48;
 static const uint16_t EEPROM_PUMP_TOTAL = 49;
-
-// NOT NEEDED. ADDRESS CAN BE USED FOR OTHER PURPOSE LATER...
-// static const uint16_t EEPROM_LAST_TIME_CLOCK_CORRECTED = 51; // 8
-
 static const uint16_t EEPROM_PUMP_STARTED = 59; // 8
 static const uint16_t EEPROM_IDLE_STARTED = 67; // 8
 static const uint16_t EEPROM_LAST_WET = 75;
@@ -67,305 +59,621 @@ static const uint16_t EEPROM_DISPLAY_MODE = 84; // 1
 static const uint16_t EEPROM_HEATER_STARTED = 85; // 8
 static const uint16_t EEPROM_HEAT_STATISTICS = 93; // 4*24 = 96
 static const uint16_t EEPROM_LAST = 188; 
+static const uint8_t LEGACY_STATISTICS_DAYS = 24;
 
 static const byte EEPROM_CHECKVALUE = 0b10101010;
 
+static const uint16_t EEPROM_JOURNAL_CONFIGURED = 190; // 1
+
+// Statistics and the journal follow, see config.h
+static const uint16_t EEPROM_JOURNAL_END = E2END + 1;
+
+static const byte EEPROM_JOURNAL_CHECKVALUE = 0b01010111;
+
+static_assert(EEPROM_STATISTICS_START + StatisticsStore<Hal>::EEPROM_SIZE <= EEPROM_JOURNAL_START,
+  "Statistics overlap the journal");
+
 static const uint32_t EPOCH_OFFSET = 1694490000;
 
-// Times, in millisecond (since starting device)
-uint64_t epochAtStart = 0;
-uint64_t timeNow = 0;
-DateTime dateTimeNow;
+// Milliseconds since EPOCH_OFFSET at reset, timeNow counts from it
+uint32_t epochAtStart = 0;
+
+// Seconds since EPOCH_OFFSET, advanced from timeNow
+uint32_t secondsNow = 0;
+uint32_t secondsNowMs = 0; // timeNow when secondsNow was last incremented
+
+// Date and time of secondsNow. Advanced a second at a time along with it, so
+// the date is converted from unix time only when the clock is set or corrected.
+struct Calendar {
+  uint16_t year;
+  uint8_t month; // 1-12
+  uint8_t day; // 1-31
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+  uint32_t hourNumber; // Hours since unix epoch
+  uint16_t dayNumber; // Days since unix epoch
+
+  uint16_t monthNumber() const { return year * 12 + month - 1; }
+
+  // Returns ROLLED_* of the numbers that changed, either way
+  uint8_t set(uint32_t unixTime) {
+    uint32_t oldHour = hourNumber;
+    uint16_t oldDay = dayNumber;
+    uint16_t oldMonth = monthNumber();
+    DateTime dateTime(unixTime);
+    year = dateTime.year();
+    month = dateTime.month();
+    day = dateTime.day();
+    hour = dateTime.hour();
+    minute = dateTime.minute();
+    second = unixTime % 60;
+    hourNumber = unixTime / 3600;
+    dayNumber = unixTime / 86400UL;
+    return (hourNumber != oldHour ? ROLLED_HOUR : 0) | (dayNumber != oldDay ? ROLLED_DAY : 0) |
+      (monthNumber() != oldMonth ? ROLLED_MONTH : 0);
+  }
+
+  // Next second. Returns ROLLED_* of the boundaries crossed.
+  uint8_t tick() {
+    if (++second < 60) return 0;
+    second = 0;
+    if (++minute < 60) return 0;
+    minute = 0;
+    hourNumber++;
+    if (++hour < 24) return ROLLED_HOUR;
+    hour = 0;
+    dayNumber++;
+    if (++day <= daysInMonth()) return ROLLED_HOUR | ROLLED_DAY;
+    day = 1;
+    if (++month > 12) {
+      month = 1;
+      year++;
+    }
+    return ROLLED_HOUR | ROLLED_DAY | ROLLED_MONTH;
+  }
 
-uint64_t lastTimeClockCorrected = 0;
-uint64_t tempLastRead = 0;
-uint64_t modeLastChanged = 0;
+  uint8_t daysInMonth() const {
+    if (month == 2) return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0 ? 29 : 28;
+    return 30 + ((month + (month >> 3)) & 1);
+  }
+};
 
-uint64_t pumpStartedMs = 0;
-uint64_t idleStartedMs = 0;
-uint64_t lastWetMs = 0;
-uint64_t forceStopStartedMs = 0;
-uint64_t motionStopStartedMs = 0;
+Calendar calendar;
+uint8_t calendarRolled = 0; // ROLLED_* not yet handled by rollOverCalendar()
 
-uint8_t statisticsCurrentDay = 0;
+// Latest crash, with the breadcrumbs left by the loop that was running, see
+// Breadcrumbs. Persisted in FIELD_LAST_RESET..FIELD_RESET_TIME. Other resets
+// are only reported, see recordReset().
+struct ResetRecord {
+  uint8_t cause; // MCUSR bits, _BV(WDRF) or 0 when the bootloader cleared them
+  uint8_t stage; // STAGE_* or BREADCRUMB_* running
+  uint8_t outputs; // BREADCRUMB_HEATER and BREADCRUMB_PUMP << zone
+  uint8_t watchdogResets; // Saturates at 255
+  uint32_t loop; // Loop counter
+  uint32_t timeNow;
+};
 
-uint8_t displayMode = 0; // DISPLAY_*
+static_assert(offsetof(ResetRecord, loop) == 4, "FIELD_LAST_RESET is the first 4 bytes");
 
-bool wasMotionStopped = false;
-bool wasForceStopped = false;
-bool wasWet = false;
-bool pumpRunning = false;
+ResetRecord lastReset;
 
-uint64_t heaterStartedMs = 0;
-uint64_t heaterIdleStartedMs = 0;
+uint32_t lastTimeClockCorrected = 0;
+uint32_t modeLastChanged = 0;
 
-bool heaterRunning = false;
+uint8_t displayMode = 0; // DISPLAY_*
 
-uint16_t minutesAgo(uint64_t timestamp) { return (timeNow - timestamp) / 1000 / 60; }
+// Display is refreshed at once when its content is invalidated, otherwise only
+// when a shown minute or the alternating mode turns over, see lcdChangesBy().
+// While pumping it is refreshed at this interval.
+static const uint16_t LCD_REFRESH_TIME = 500;
+// ...or this soon when the I2C queue was full
+static const uint16_t LCD_RETRY_TIME = 20;
+
+// Buttons and sensors are polled, so we can not sleep longer than this.
+static const uint16_t INPUT_POLL_TIME = 120;
+// Pin change interrupts wake for buttons and motion, water level is polled this often
+static const uint16_t PIN_WAKE_POLL_TIME = 8000;
+
+// Boot runs in phases. setup() makes outputs safe and restores the journal, so
+// that the first loop iteration already decides on pump and heater. Slow
+// initialization the control does not need follows, one phase per loop
+// iteration, see continueBoot(). Time since reset at the end of each phase is
+// kept for the profile.
+static const uint8_t BOOT_OUTPUTS = 0; // Pins configured, pump and heater off
+static const uint8_t BOOT_CLOCK = 1; // Time read from RTC
+static const uint8_t BOOT_JOURNAL = 2; // Timestamps and tunables restored
+static const uint8_t BOOT_CONTROL = 3; // First pump and heater decisions made
+static const uint8_t BOOT_LCD = 4;
+static const uint8_t BOOT_SENSORS = 5; // Bus searched, probes assigned
+static const uint8_t BOOT_LOG = 6; // Sensor log found
+static const uint8_t BOOT_STATS = 7; // Statistics printed
+static const uint8_t BOOT_PHASE_COUNT = 8;
+
+const char BOOT_PHASE_NAMES[BOOT_PHASE_COUNT][8] PROGMEM = {"outputs", "clock", "journal", "control", "lcd", "sensors", "log", "stats"};
+
+uint32_t bootPhaseUs[BOOT_PHASE_COUNT];
+uint8_t bootPhase = BOOT_OUTPUTS; // Next phase to finish
+
+void endBootPhase(uint8_t phase) {
+  bootPhaseUs[phase] = micros();
+  bootPhase = phase + 1;
+}
 
-static const uint16_t PUMP_WATER_SPEED = 106;  // Pump speed, ml per 100 seconds
+bool isBooting() { return bootPhase < BOOT_PHASE_COUNT; }
 
-// Convert millilitres to milliseconds and vice versa
-uint64_t mlToMs(uint32_t millilitres) { return 100000 * millilitres / PUMP_WATER_SPEED; }
-uint32_t msToMl(uint64_t milliseconds) { return milliseconds * PUMP_WATER_SPEED / 100000; }
+// LCD task is armed once the display has been initialized
+void invalidateLcd() {
+  if (bootPhase > BOOT_LCD) scheduleNow(TASK_LCD);
+}
 
+uint16_t minutesAgo(uint32_t timestamp) { return (timeNow - timestamp) / 1000 / 60; }
 
-static const uint32_t ONE_SECOND = 1000;
-static const uint32_t ONE_HOUR = 3600000;
-static const uint32_t ONE_MINUTE = ONE_HOUR/60;
-static const uint32_t FIFTEEN_MINUTES = ONE_MINUTE*15;
 
-static const float TEMP_LIMIT = 5.0;
-static const float TEMP_ALARM_LOW = 3.0;
+static const uint32_t FIFTEEN_MINUTES = ONE_MINUTE*15;
 
-static const uint32_t HEATER_POWER = 50; // Watts
-static const uint32_t TARGET_POWER = 5; // Watts
-static const uint32_t HEATER_ON_TIME = 5*ONE_SECOND;
-static const uint32_t HEATER_IDLE_TIME = HEATER_POWER * (float)HEATER_ON_TIME / TARGET_POWER - HEATER_ON_TIME;  
+uint16_t logInterval = 30; // Seconds between sensor log samples, a tunable like those of unit.h
 
 static const uint8_t DISPLAY_SUMMER = 0;
 static const uint8_t DISPLAY_WINTER = 1;
 static const uint8_t DISPLAY_INTERVAL = 2;
 
 uint8_t modeNow = DISPLAY_SUMMER;
+uint8_t lcdZone = 0; // Zone shown, rotated with modeNow
 
-static const uint16_t CONTAINER_SIZE = 28000;  // Water container size in (ml)
+bool showBootInfo = true;
 
-static const uint16_t PUMP_PORTION = 100;       // Amount of water pumped at once (ml)
-static const uint32_t PERIOD_TIME = 15*ONE_MINUTE; // Adjusted water amount is PUMP_PORTION / PERIOD_TIME.
+OneWire oneWire(ONE_WIRE_PIN);
+DallasTemperature sensors(&oneWire);
 
+#ifndef USE_ASYNC_I2C
+LiquidCrystal_I2C lcd(LCD_I2C_ADDRESS, 16, 2);
+DS3231 rtc;
+#endif
 
-static const uint32_t PUMP_TIME = mlToMs(PUMP_PORTION);
-static const uint32_t IDLE_TIME = PERIOD_TIME - PUMP_TIME;
+static const uint32_t TELEMETRY_BAUD = 115200;
+
+// Telemetry events, EVENT_* of unit.h, are queued into a ring buffer and
+// written to serial port only as fast as its transmit buffer has room, so the
+// loop never blocks on serial.
+const char EVENT_CODES[][3] PROGMEM = {"PS", "PE", "HS", "HE", "T", "A", "M", "D", "R"};
+
+struct TelemetryEvent {
+  uint8_t type;
+  uint8_t zone; // Of pump events
+  uint32_t time; // Seconds since EPOCH_OFFSET
+  int32_t value;
+};
+
+static const uint8_t TELEMETRY_QUEUE_SIZE = 16;
+TelemetryEvent telemetryQueue[TELEMETRY_QUEUE_SIZE];
+uint8_t telemetryHead = 0; // Next event to send
+uint8_t telemetryCount = 0;
+uint16_t telemetryDropped = 0; // Not yet reported
+uint32_t telemetryDroppedTotal = 0;
+
+// Serial output in progress, either a telemetry line or a protocol frame.
+// It is sent only as fast as the transmit buffer has room, see drainSerial().
+static const uint8_t SERIAL_OUT_SIZE = 160;
+uint8_t serialOut[SERIAL_OUT_SIZE];
+uint8_t serialOutLength = 0;
+uint8_t serialOutSent = 0;
+
+bool pushEvent(uint8_t type, uint8_t zone, int32_t value) {
+  if (telemetryCount == TELEMETRY_QUEUE_SIZE) return false;
+  TelemetryEvent &event = telemetryQueue[(telemetryHead + telemetryCount) % TELEMETRY_QUEUE_SIZE];
+  event.type = type;
+  event.zone = zone;
+  event.time = secondsNow;
+  event.value = value;
+  telemetryCount++;
+  return true;
+}
 
-static const uint32_t WET_TIME = ONE_HOUR;
-static const uint32_t DRY_TOO_LONG_TIME = ONE_HOUR*48;
+void sendZoneEvent(uint8_t type, uint8_t zone, int32_t value) {
+#ifdef USE_UPLINK
+  recordUplinkEvent(type, zone, value);
+#endif
+  // Keep one slot free for reporting drops
+  if (telemetryCount < TELEMETRY_QUEUE_SIZE - 1 && (!telemetryDropped || pushEvent(EVENT_DROPPED, 0, telemetryDropped))) {
+    telemetryDropped = 0;
+    pushEvent(type, zone, value);
+  } else {
+    telemetryDropped++;
+    telemetryDroppedTotal++;
+  }
+}
 
-static const uint32_t FORCE_STOP_TIME = ONE_HOUR;
-static const uint32_t MOTION_STOP_TIME = ONE_MINUTE * 15;
+// Move oldest queued event into serial output as a text line. With several
+// zones, code of a pump event ends with the zone number, like "PS1".
+void formatNextEvent() {
+  const TelemetryEvent &event = telemetryQueue[telemetryHead];
+  char *out = (char*)serialOut;
+  strcpy_P(out, EVENT_CODES[event.type]);
+  uint8_t length = strlen(out);
+  if (ZONE_COUNT > 1 && (event.type == EVENT_PUMP_START || event.type == EVENT_PUMP_STOP)) {
+    out[length++] = '0' + event.zone;
+  }
+  serialOutLength = length + snprintf_P(out + length, SERIAL_OUT_SIZE - length, PSTR(" %lu %ld\n"),
+    (unsigned long)(event.time + EPOCH_OFFSET), (long)event.value);
+  serialOutSent = 0;
+  telemetryHead = (telemetryHead + 1) % TELEMETRY_QUEUE_SIZE;
+  telemetryCount--;
+}
 
+#ifdef USE_UPLINK
+// Telemetry events, hourly statistics and water state are batched for the
+// uplink coprocessor, see uplink.h. The batch is sent every UPLINK_INTERVAL or
+// when it fills up, an alarm change is sent at once ahead of it. Frames are
+// written only as fast as the transmit buffer has room, see drainUplink().
+static const uint32_t UPLINK_BAUD = 115200;
+static const uint32_t UPLINK_INTERVAL = FIFTEEN_MINUTES;
+// Temperature is read every 10 s. Between reports only a change this large is recorded.
+static const int16_t UPLINK_TEMPERATURE_STEP = 50;
+
+UplinkBatch uplinkBatch;
+bool uplinkBatchDue = false; // Send the batch once output is free
+UplinkAlarm uplinkAlarm;
+bool uplinkAlarmPending = false;
+uint8_t uplinkSequence = 0;
+uint16_t uplinkDropped = 0; // Records not yet reported
+int16_t uplinkTemperature = 0; // Latest recorded
+uint8_t uplinkOut[UPLINK_FRAME_SIZE];
+uint8_t uplinkOutLength = 0;
+uint8_t uplinkOutSent = 0;
+
+bool isUplinkSending() { return uplinkOutSent != uplinkOutLength; }
+
+// False when the batch is full and the previous frame is still being sent
+bool addUplinkRecord(uint8_t kind, uint8_t zone, int32_t value) {
+  if (!uplinkBatch.hasRoom()) {
+    uplinkBatchDue = true;
+    drainUplink();
+  }
+  return uplinkBatch.hasRoom() && uplinkBatch.add(kind, zone, secondsNow + EPOCH_OFFSET, value);
+}
 
-float temperature = TEMP_LIMIT + 1; // in celsius 
-bool tempSensorFail = false;
-bool showBootInfo = true;
+void recordUplink(uint8_t kind, uint8_t zone, int32_t value) {
+  if (uplinkDropped && addUplinkRecord(UPLINK_DROPPED, 0, uplinkDropped)) uplinkDropped = 0;
+  if (uplinkDropped || !addUplinkRecord(kind, zone, value)) uplinkDropped++;
+  if (kind == EVENT_TEMPERATURE) uplinkTemperature = value;
+}
 
-OneWire oneWire(ONE_WIRE_PIN);
-DallasTemperature sensors(&oneWire);
+void recordUplinkEvent(uint8_t type, uint8_t zone, int32_t value) {
+  if (type == EVENT_TEMPERATURE && abs(value - uplinkTemperature) < UPLINK_TEMPERATURE_STEP) return;
+  recordUplink(type, zone, value);
+}
 
-LiquidCrystal_I2C lcd(0x3F, 16, 2);
-DS3231 rtc;
+// Called when the hour has rolled over
+void recordUplinkHour() {
+  StatisticsBucket hour = statistics.bucket(STATISTICS_HOURLY, 1);
+  recordUplink(UPLINK_HOUR_PUMPED, 0, hour.pumpedMl);
+  recordUplink(UPLINK_HOUR_HEATED, 0, hour.heatedS);
+}
 
-void initializePins() {
-  pinMode(BUTTON1_PIN, INPUT_PULLUP);
-  pinMode(BUTTON2_PIN, INPUT_PULLUP);
-  pinMode(BUTTON3_PIN, INPUT_PULLUP);
-  pinMode(BUTTON4_PIN, INPUT_PULLUP);
-  pinMode(BUTTON5_PIN, INPUT_PULLUP);
-  pinMode(BUTTON6_PIN, INPUT_PULLUP);
-  pinMode(BUTTON7_PIN, INPUT_PULLUP);
-  pinMode(BUTTON8_PIN, INPUT_PULLUP);
-  pinMode(MOTION_PIN, INPUT);
-
-  pinMode(IN_MOISTURE1_PIN, INPUT);
-  pinMode(OUT_PUMP_PIN, OUTPUT);
-  pinMode(OUT_HEATER_PIN, OUTPUT);
-  pinMode(LED_BUILTIN, OUTPUT);
-  pinMode(ALARM_PIN, OUTPUT);
-
-  pinMode(MOTION_GROUND_PIN, OUTPUT);
-  digitalWrite(MOTION_GROUND_PIN, LOW);
-
-  pinMode(WATER_LEVEL_PIN, INPUT_PULLUP);
-  
-  digitalWrite(LED_BUILTIN, LOW);
-  digitalWrite(ALARM_PIN, LOW);
-  digitalWrite(OUT_PUMP_PIN, LOW);
-  digitalWrite(OUT_HEATER_PIN, LOW);
+void sendUplinkAlarm(const AlarmConditions &conditions) {
+  uplinkAlarm.time = secondsNow + EPOCH_OFFSET;
+  uplinkAlarm.running = alarmEvaluator.running;
+  uplinkAlarm.flags = (conditions.tempSensorFail ? UPLINK_ALARM_SENSOR_FAIL : 0) |
+    (conditions.dryTooLong ? UPLINK_ALARM_DRY_TOO_LONG : 0) |
+    (conditions.forceStopped ? UPLINK_ALARM_FORCE_STOPPED : 0) | (conditions.winter ? UPLINK_ALARM_WINTER : 0);
+  uplinkAlarm.temperature = conditions.temperature;
+  uplinkAlarm.leftWaterMl = conditions.leftWaterMl;
+  uplinkAlarmPending = true; // A newer alarm not yet sent replaces the older one
+  drainUplink();
 }
 
-void readEeprom() {
-  if (eeprom_read_byte(EEPROM_CONFIGURED) != EEPROM_CHECKVALUE) {
-    resetEEPROM();
+// Temperature and water state are sampled into the batch, which is then sent
+void sendUplinkReport() {
+  recordUplink(EVENT_TEMPERATURE, 0, temperature);
+  recordUplink(UPLINK_WATER_LEFT, 0, leftWaterMl());
+  uint8_t wet = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (zones[zone].waterLevel) wet |= 1 << zone;
   }
-  for (uint16_t i = 0; i < 24; i++) {
-    pumpStatistics[i] = eeprom_read_word(EEPROM_PUMP_STATISTICS + i*2);
-    heatStatistics[i] = eeprom_read_dword(EEPROM_HEAT_STATISTICS + i*4);
+  recordUplink(UPLINK_WATER_LEVEL, 0, wet);
+  uplinkBatchDue = true;
+  schedule(TASK_UPLINK, timeNow + UPLINK_INTERVAL);
+}
+
+// Like drainSerial(), the alarm goes before the batch but does not cut a frame
+void drainUplink() {
+  while (true) {
+    if (!isUplinkSending()) {
+      if (uplinkAlarmPending) {
+        uplinkAlarm.sequence = uplinkSequence++;
+        uplinkOutLength = uplinkFrame(uplinkOut, UPLINK_FRAME_ALARM, &uplinkAlarm, sizeof(uplinkAlarm));
+        uplinkAlarmPending = false;
+      } else if (uplinkBatchDue && uplinkBatch.count) {
+        uplinkOutLength = uplinkBatch.take(uplinkOut, uplinkSequence++);
+        uplinkBatchDue = false;
+      } else {
+        uplinkBatchDue = false;
+        return;
+      }
+      uplinkOutSent = 0;
+    }
+    int room = UPLINK_SERIAL.availableForWrite();
+    if (room <= 0) return;
+    uint8_t length = uplinkOutLength - uplinkOutSent;
+    if (length > room) length = room;
+    UPLINK_SERIAL.write(uplinkOut + uplinkOutSent, length);
+    uplinkOutSent += length;
   }
+}
+#else
+bool isUplinkSending() { return false; }
+#endif
 
-  pumpedTotal = eeprom_read_word(EEPROM_PUMP_TOTAL);
+void* fieldData(uint8_t field, uint8_t &size) {
+  switch (field) {
+    case FIELD_DISPLAY_MODE: size = sizeof(displayMode); return &displayMode;
+    case FIELD_LAST_RESET: size = offsetof(ResetRecord, loop); return &lastReset;
+    case FIELD_RESET_LOOP: size = sizeof(lastReset.loop); return &lastReset.loop;
+    case FIELD_RESET_TIME: size = sizeof(lastReset.timeNow); return &lastReset.timeNow;
+    case FIELD_LOG_INTERVAL: size = sizeof(logInterval); return &logInterval;
+  }
+  return unitFieldData(field, size);
+}
 
-  eeprom_read_block(&pumpStartedMs, EEPROM_PUMP_STARTED, 8); 
-  eeprom_read_block(&idleStartedMs, EEPROM_IDLE_STARTED, 8); 
-  eeprom_read_block(&heaterStartedMs, EEPROM_HEATER_STARTED, 8); 
+Journal<Hal, FIELD_COUNT> journal(EEPROM_JOURNAL_START, EEPROM_JOURNAL_END, fieldData);
 
-  eeprom_read_block(&lastWetMs, EEPROM_LAST_WET, 8); 
- 
-  statisticsCurrentDay = eeprom_read_byte(EEPROM_STATS_CUR_DAY); 
-  displayMode = eeprom_read_byte(EEPROM_DISPLAY_MODE);
+void formatJournal() {
+  journal.format();
+  scheduleNever(TASK_EEPROM);
+  eeprom_update_byte(EEPROM_JOURNAL_CONFIGURED, EEPROM_JOURNAL_CHECKVALUE);
+  // Do not migrate the legacy image again after the journal is reformatted
+  eeprom_update_byte(EEPROM_CONFIGURED, 0);
 }
 
-void saveEeprom() {
-  for (uint16_t i = 0; i < 24; i++) {
-    eeprom_update_word(EEPROM_PUMP_STATISTICS + i*2, pumpStatistics[i]);
-    eeprom_update_dword(EEPROM_HEAT_STATISTICS + i*4, heatStatistics[i]);
+uint32_t currentHour() { return calendar.hourNumber; }
+uint16_t currentDay() { return calendar.dayNumber; }
+uint16_t currentMonth() { return calendar.monthNumber(); }
+
+// Older units kept daily statistics only, today first. They become ended days
+// of the new statistics, months start from zero.
+void importStatistics(const uint16_t *pumped, const uint32_t *heatedMs) {
+  statistics.clear(currentHour(), currentDay(), currentMonth());
+  for (uint8_t i = 0; i < LEGACY_STATISTICS_DAYS; i++) {
+    statistics.importDay(i, pumped[i], (heatedMs[i] + 500) / 1000);
   }
- 
-  eeprom_update_word(EEPROM_PUMP_TOTAL, pumpedTotal);
-  
-  eeprom_update_block(&pumpStartedMs, EEPROM_PUMP_STARTED, 8);
-  eeprom_update_block(&idleStartedMs, EEPROM_IDLE_STARTED, 8);
-  eeprom_update_block(&heaterStartedMs, EEPROM_HEATER_STARTED, 8);
+}
 
-  eeprom_update_block(&lastWetMs, EEPROM_LAST_WET, 8);
+void readLegacyEeprom() {
+  uint16_t pumped[LEGACY_STATISTICS_DAYS];
+  uint32_t heated[LEGACY_STATISTICS_DAYS];
+  for (uint8_t i = 0; i < LEGACY_STATISTICS_DAYS; i++) {
+    pumped[i] = eeprom_read_word(EEPROM_PUMP_STATISTICS + i*2);
+    heated[i] = eeprom_read_dword(EEPROM_HEAT_STATISTICS + i*4);
+  }
+  importStatistics(pumped, heated);
 
-  eeprom_update_byte(EEPROM_STATS_CUR_DAY, statisticsCurrentDay);
-  eeprom_update_byte(EEPROM_DISPLAY_MODE, displayMode);
-}
+  statistics.pumpedTotal = eeprom_read_word(EEPROM_PUMP_TOTAL);
 
+  // Legacy timestamps are 64 bit, low half is the same timestamp in the 32 bit timebase
+  zones[0].pump.startedMs = eeprom_read_dword(EEPROM_PUMP_STARTED); 
+  zones[0].pump.idleStartedMs = eeprom_read_dword(EEPROM_IDLE_STARTED); 
+  heater.startedMs = eeprom_read_dword(EEPROM_HEATER_STARTED); 
 
-void dayPassed() {
-  for (int16_t i = 23; i > 0; i--) {
-    pumpStatistics[i] = pumpStatistics[i - 1];
-    heatStatistics[i] = heatStatistics[i - 1];
-  }
-  pumpStatistics[0] = 0;
-  heatStatistics[0] = 0;
+  zones[0].lastWetMs = eeprom_read_dword(EEPROM_LAST_WET); 
+
+  displayMode = eeprom_read_byte(EEPROM_DISPLAY_MODE);
 }
 
-void resetEEPROM() {
-  for (int16_t i = 23; i >= 0; i--) {
-    pumpStatistics[i] = 0;
-    heatStatistics[i] = 0;
+void readEeprom() {
+  if (eeprom_read_byte(EEPROM_JOURNAL_CONFIGURED) != EEPROM_JOURNAL_CHECKVALUE) {
+    if (eeprom_read_byte(EEPROM_CONFIGURED) == EEPROM_CHECKVALUE) {
+      readLegacyEeprom();
+      formatJournal();
+    } else {
+      resetEEPROM();
+    }
   }
+  journal.mount();
+}
 
-  pumpedTotal = 0;
-  pumpStartedMs = timeNow;
-  idleStartedMs = timeNow;
-  lastWetMs = 0;
-  forceStopStartedMs = 0;
-  statisticsCurrentDay = dateTimeNow.day();
-  eeprom_update_byte(EEPROM_CONFIGURED, EEPROM_CHECKVALUE);
-  saveEeprom();
-  //readEeprom();
+// Statistics roll over at hour, day and month boundaries of the RTC time, see
+// rollOverStatistics(). Called when the calendar has crossed one, see calendarRolled.
+void rollOverCalendar() {
+  calendarRolled = 0;
+#ifdef USE_UPLINK
+  if (rollOverStatistics() & ROLLED_HOUR) recordUplinkHour();
+#else
+  rollOverStatistics();
+#endif
+}
+
+void resetEEPROM() {
+  resetUnit();
+  formatJournal();
 }
 
-static const uint16_t BUF_SIZE = 18;
+static const uint8_t LCD_COLUMNS = 16;
+
+// Lines to be shown. Formats need not pad, renderLcdLine() does.
+static const uint16_t BUF_SIZE = LCD_COLUMNS + 1;
 char lcdBuf1[BUF_SIZE];
 char lcdBuf2[BUF_SIZE];
 
-char lcdBuf1a[BUF_SIZE];
-char lcdBuf2a[BUF_SIZE];
+// What is currently shown on the display
+char lcdBuf1a[LCD_COLUMNS];
+char lcdBuf2a[LCD_COLUMNS];
+
+// Parts of a line are formatted into stack buffers of this size, see formatFixed()
+static const uint8_t NUM_BUF_SIZE = 14;
 
-char floatBuf1[BUF_SIZE];
-char floatBuf2[BUF_SIZE];
-char floatBuf3[BUF_SIZE];
-char timeOrTempBuf[BUF_SIZE];
 
+// Earliest time the display content changes by itself
+uint32_t lcdChangesAt = 0;
+
+void lcdChangesBy(uint32_t deadline) {
+  if ((int32_t)(deadline - lcdChangesAt) < 0) lcdChangesAt = deadline;
+}
 
-void updateLcdSummer() {
-  dtostrf((float)(pumpStatistics[0]/1000.0), 4, 1, floatBuf1);
-  dtostrf((float)(pumpStatistics[1]/1000.0), 4, 1, floatBuf2);
+// minutesAgo() of a value shown, refresh when it turns over
+uint16_t lcdMinutesAgo(uint32_t timestamp) {
+  lcdChangesBy(timeNow + ONE_MINUTE - (timeNow - timestamp) % ONE_MINUTE);
+  return minutesAgo(timestamp);
+}
+
+// Send only the characters that differ from what is shown on the display.
+// Line is padded with spaces to the full width of the display. Returns false
+// if the I2C queue got full, rest of the line is sent on the next refresh.
+bool renderLcdLine(uint8_t row, const char *line, char *shown) {
+  bool ended = false;
+  uint8_t cursor = LCD_COLUMNS;
+  for (uint8_t col = 0; col < LCD_COLUMNS; col++) {
+    if (!line[col]) ended = true;
+    char c = ended ? ' ' : line[col];
+    if (c == shown[col]) continue;
+    if (cursor != col && !Hal::setLcdCursor(col, row)) return false;
+    if (!Hal::writeLcd(c)) return false;
+    shown[col] = c;
+    cursor = col + 1;
+  }
+  return true;
+}
+
+// Format fixed point value with given number of decimals, right aligned
+// to width like dtostrf(). For example (-53, 1, 5) gives " -5.3".
+char *formatFixed(char *buf, int32_t value, uint8_t decimals, uint8_t width) {
+  char digits[12];
+  uint8_t len = 0;
+  bool negative = value < 0;
+  uint32_t v = negative ? -value : value;
+  uint8_t minLen = decimals ? decimals + 2 : 1; // Always at least "0.x"
+  do {
+    digits[len++] = '0' + v % 10;
+    v /= 10;
+    if (len == decimals) digits[len++] = '.';
+  } while (v > 0 || len < minLen);
+  if (negative) digits[len++] = '-';
+
+  uint8_t pos = 0;
+  while (pos + len < width) buf[pos++] = ' ';
+  while (len > 0) buf[pos++] = digits[--len];
+  buf[pos] = 0;
+  return buf;
+}
+
+// Temperature with one decimal
+char *formatTemperature(char *buf) { return formatFixed(buf, divRound(temperature, 10), 1, 4); }
+
+// With several zones, water level and times are of lcdZone, marked by its number
+void updateLcdSummer(const char *timeOrTemp) {
+  const Zone &zone = zones[lcdZone];
+  char numBuf1[NUM_BUF_SIZE];
+  char numBuf2[NUM_BUF_SIZE];
+  formatFixed(numBuf1, divRound(statistics.day(0).pumpedMl, 100), 1, 4); // Litres, today and yesterday
+  formatFixed(numBuf2, divRound(statistics.day(1).pumpedMl, 100), 1, 4);
   
-  int32_t totalMinutes = minutesAgo(waterLevel ? pumpStartedMs: lastWetMs);
+  int32_t totalMinutes = lcdMinutesAgo(zone.waterLevel ? zone.pump.startedMs: zone.lastWetMs);
   int32_t hours = totalMinutes/60;
   int32_t minutesLeft = totalMinutes - hours*60;
-  uint16_t waterRemainingPercent = ((float)(CONTAINER_SIZE - pumpedTotal - 1) / CONTAINER_SIZE)*100;
-  snprintf(lcdBuf1, BUF_SIZE, "%s %s %luh %lum         ", floatBuf1, floatBuf2, hours, minutesLeft);
-  snprintf(lcdBuf2, BUF_SIZE, "%2d%% %s%s%s %s           ", 
+  int16_t waterRemainingPercent = (leftWaterMl() - 1) * 100 / CONTAINER_SIZE;
+  snprintf_P(lcdBuf1, BUF_SIZE, PSTR("%s %s %luh %lum"), numBuf1, numBuf2, hours, minutesLeft);
+  snprintf_P(lcdBuf2, BUF_SIZE, PSTR("%2d%%%c%s%s%s %s"),
     waterRemainingPercent,
-    waterLevel ? "We" : "Dr",
+    ZONE_COUNT > 1 ? '0' + lcdZone : ' ',
+    zone.waterLevel ? "We" : "Dr",
     motionSns ? "Mo": "  ",
-    cantStart() ? "St" : "  ", 
-    timeOrTempBuf
+    cantStart(lcdZone) ? "St" : "  ", 
+    timeOrTemp
   );
+  // Timed stops end by themselves, and St with them
+  if (wetRecently(lcdZone)) lcdChangesBy(zone.lastWetMs + CONFIG.wetTime);
+  if (forceStoppedRecently()) lcdChangesBy(forceStopStartedMs + CONFIG.forceStopTime);
+  if (motionStoppedRecently()) lcdChangesBy(motionStopStartedMs + CONFIG.motionStopTime);
 }
 
-void updateLcdWinter() {
-  int32_t totalMinutes = minutesAgo(heaterStartedMs);
+void updateLcdWinter(const char *timeOrTemp) {
+  int32_t totalMinutes = lcdMinutesAgo(heater.startedMs);
   int32_t hours = totalMinutes/60;
   int32_t minutesLeft = totalMinutes - hours*60;
 
-  dtostrf((float)(heatStatistics[0]/60000.0), 4, 1, floatBuf1); // Show heat on in minutes 
-  dtostrf((float)(heatStatistics[1]/60000.0), 4, 1, floatBuf2);
-  dtostrf(temperature, 4, 1, floatBuf3);
-  snprintf(lcdBuf1, BUF_SIZE, "%s %s %luh %lum         ", floatBuf1, floatBuf2, hours, minutesLeft);    
-  snprintf(lcdBuf2, BUF_SIZE, "%sC %s%s %s                    ", 
-    floatBuf3, 
-    heaterRunning ? "He" : "  ",
-    tempSensorFail ? "!!" : "  ",
-    timeOrTempBuf
+  char numBuf1[NUM_BUF_SIZE];
+  char numBuf2[NUM_BUF_SIZE];
+  char numBuf3[NUM_BUF_SIZE];
+  formatFixed(numBuf1, divRound(statistics.day(0).heatedS, 6), 1, 4); // Show heat on in minutes 
+  formatFixed(numBuf2, divRound(statistics.day(1).heatedS, 6), 1, 4);
+  formatTemperature(numBuf3);
+  snprintf_P(lcdBuf1, BUF_SIZE, PSTR("%s %s %luh %lum"), numBuf1, numBuf2, hours, minutesLeft);
+  snprintf_P(lcdBuf2, BUF_SIZE, PSTR("%sC %s%s %s"),
+    numBuf3, 
+    heater.running ? "He" : "  ",
+    tempSensorFail() ? "!!" : "  ",
+    timeOrTemp
   );
 }
 
 void updateLcd() {
-  bool showForceStop = !digitalRead(BUTTON4_PIN);
-  bool showResetContainer = !digitalRead(BUTTON6_PIN);
-  bool backlightBtn = !digitalRead(BUTTON3_PIN);
-  bool showTimes = !digitalRead(BUTTON1_PIN);
-  bool showContainer = !digitalRead(BUTTON5_PIN);
-  float leftWater = (CONTAINER_SIZE - pumpedTotal)/1000.0;
+  bool showForceStop = isPressed(INPUT_BUTTON4);
+  bool showResetContainer = isPressed(INPUT_BUTTON6);
+  bool showTimes = isPressed(INPUT_BUTTON1);
+  bool showContainer = isPressed(INPUT_BUTTON5);
   
   if (timeNow - modeLastChanged > 5000) {
     modeLastChanged = timeNow;
     modeNow = (modeNow + 1)%2;
+    lcdZone = (lcdZone + 1) % ZONE_COUNT;
   }
-
-  if (displayMode == DISPLAY_WINTER || modeNow == 0) {
-    snprintf(timeOrTempBuf, BUF_SIZE, "%2u:%02u               ", dateTimeNow.hour(), dateTimeNow.minute());
+  // Units that can not pump only have the winter page
+  uint8_t page = CONFIG.canPump() ? displayMode : DISPLAY_WINTER;
+  // Clock is shown to the minute
+  lcdChangesAt = secondsNowMs + (60 - calendar.second) * ONE_SECOND;
+  // Time and temperature alternate, and so do zones
+  if (page != DISPLAY_WINTER || ZONE_COUNT > 1) lcdChangesBy(modeLastChanged + 5001);
+  // Pumped today grows
+  if (anyPumpRunning()) lcdChangesBy(timeNow + LCD_REFRESH_TIME);
+
+  char numBuf[NUM_BUF_SIZE];
+  char timeOrTemp[NUM_BUF_SIZE];
+  if (page == DISPLAY_WINTER || modeNow == 0) {
+    snprintf_P(timeOrTemp, NUM_BUF_SIZE, PSTR("%2u:%02u"), calendar.hour, calendar.minute);
   } else {
-    dtostrf(temperature, 4, 1, floatBuf3);
-    snprintf(timeOrTempBuf, BUF_SIZE, "%sC              ", floatBuf3);
+    formatTemperature(numBuf);
+    snprintf_P(timeOrTemp, NUM_BUF_SIZE, PSTR("%sC"), numBuf);
   }
   
   if(showContainer) {
-    float pumpedTotalLitres = pumpedTotal / 1000.0;
-    dtostrf(pumpedTotalLitres, 0, 2, floatBuf1);
-    snprintf(lcdBuf1, BUF_SIZE, "Pumped: %s l        ", floatBuf1);
-    dtostrf(leftWater, 0, 2, floatBuf1);
-    snprintf(lcdBuf2, BUF_SIZE, "Left: %s l        ", floatBuf1);
+    formatFixed(numBuf, divRound(statistics.pumpedTotal, 10), 2, 0);
+    snprintf_P(lcdBuf1, BUF_SIZE, PSTR("Pumped: %s l"), numBuf);
+    formatFixed(numBuf, divRound(leftWaterMl(), 10), 2, 0);
+    snprintf_P(lcdBuf2, BUF_SIZE, PSTR("Left: %s l"), numBuf);
   }
   else if (showForceStop) {
-    snprintf(lcdBuf1, BUF_SIZE, "Force stopping                 ");
-    snprintf(lcdBuf2, BUF_SIZE, "for 1 hour                     ");
+    strcpy_P(lcdBuf1, PSTR("Force stopping"));
+    strcpy_P(lcdBuf2, PSTR("for 1 hour"));
   }
   else if (showResetContainer) {
-    snprintf(lcdBuf1, BUF_SIZE, "Container                    ");
-    snprintf(lcdBuf2, BUF_SIZE, "filled                       ");
+    strcpy_P(lcdBuf1, PSTR("Container"));
+    strcpy_P(lcdBuf2, PSTR("filled"));
   }
   else if (showTimes) {  
-    snprintf(lcdBuf1, BUF_SIZE, "Wet %u min ago        ", minutesAgo(lastWetMs));
-    snprintf(lcdBuf2, BUF_SIZE, "Pumped %u min ago        ", minutesAgo(pumpStartedMs));
+    snprintf_P(lcdBuf1, BUF_SIZE, PSTR("Wet %u min ago"), lcdMinutesAgo(zones[lcdZone].lastWetMs));
+    snprintf_P(lcdBuf2, BUF_SIZE, PSTR("Pumped %u min ago"), lcdMinutesAgo(zones[lcdZone].pump.startedMs));
   } else {
-    if(displayMode == DISPLAY_SUMMER) {
-      updateLcdSummer();
-    } else if(displayMode == DISPLAY_WINTER) {
-      updateLcdWinter();
-    } else if(displayMode == DISPLAY_INTERVAL) {
-      if(modeNow == DISPLAY_SUMMER) updateLcdSummer();
-      else updateLcdWinter();
+    if(page == DISPLAY_SUMMER) {
+      updateLcdSummer(timeOrTemp);
+    } else if(page == DISPLAY_WINTER) {
+      updateLcdWinter(timeOrTemp);
+    } else if(page == DISPLAY_INTERVAL) {
+      if(modeNow == DISPLAY_SUMMER) updateLcdSummer(timeOrTemp);
+      else updateLcdWinter(timeOrTemp);
     }
   }
-  if (!showBootInfo && strcmp(lcdBuf1a, lcdBuf1) != 0) {
-    lcd.setCursor(0, 0);
-    lcd.print(lcdBuf1);
-    strcpy(lcdBuf1a, lcdBuf1);
-  }
-  if (strcmp(lcdBuf2a, lcdBuf2) != 0) {
-    lcd.setCursor(0, 1);
-    lcd.print(lcdBuf2);
-    strcpy(lcdBuf2a, lcdBuf2);
-  }
+  bool rendered = showBootInfo || renderLcdLine(0, lcdBuf1, lcdBuf1a);
+  rendered = rendered && renderLcdLine(1, lcdBuf2, lcdBuf2a);
+  schedule(TASK_LCD, rendered ? lcdChangesAt : timeNow + LCD_RETRY_TIME);
 }
 
 void printBootInfo() {
-  snprintf(timeOrTempBuf, BUF_SIZE, "%u.%u %2u:%02u               ", dateTimeNow.day(), dateTimeNow.month(), dateTimeNow.hour(), dateTimeNow.minute());
-  snprintf(lcdBuf1, BUF_SIZE, "BTN1 %s", timeOrTempBuf);  
-  lcd.setCursor(0, 0);
-  lcd.print(lcdBuf1);
+  snprintf_P(lcdBuf1, BUF_SIZE, PSTR("BTN1 %u.%u %2u:%02u"), calendar.day, calendar.month, calendar.hour, calendar.minute);
+  renderLcdLine(0, lcdBuf1, lcdBuf1a);
 }
 
-uint64_t blinkStoppedMs = 0;
-uint64_t blinkStartedMs = 0;
+uint32_t blinkStoppedMs = 0;
+uint32_t blinkStartedMs = 0;
 bool blinkNow = false;
 
 void manageBlink() {
@@ -377,320 +685,1144 @@ void manageBlink() {
     blinkNow = false;
     blinkStoppedMs = timeNow;
   }
+  schedule(TASK_BLINK, blinkNow ? blinkStartedMs + 51 : blinkStoppedMs + 30001);
 }
 
 bool isBeeping() {
-  bool backlightBtn = !digitalRead(BUTTON3_PIN);
-  return backlightBtn || (blinkNow && alarmRunning);
+  return isPressed(INPUT_BUTTON3) || (blinkNow && alarmEvaluator.running);
 }
 
 void updateBeeper() {
-  analogWrite(ALARM_PIN, isBeeping() ? 50 : 0);
+  Hal::setBeeper(isBeeping() ? 50 : 0);
 }
 
 void manageBuiltinLedBlink() {
   if(blinkNow) {
-    digitalWrite(LED_BUILTIN, HIGH);
+    Hal::setLed(true);
   } else {
     updateBuiltinLed();
   }
 }
 
-bool forceStopPressed = false;
-bool resetButtonPressed = false;
-bool backlightButtonPressed = false;
-bool backlightOn = false;
-bool resetContainerPressed = false;
-bool forceRunPressed = false;
-bool modeChangePressed = false;
+// Debounced state of each input follows its raw pin state once that has been
+// stable for DEBOUNCE_TIME, so a bouncing button or a chattering motion sensor
+// does not hold back the others, like the water level.
+void sampleInputs() {
+  uint16_t raw = Hal::readInputs();
+  uint16_t changed = raw ^ rawInputs;
+  rawInputs = raw;
+  uint16_t previous = inputs;
+  uint16_t pending = changed | (raw ^ inputs);
+  for (uint8_t bit = 0; pending; bit++, pending >>= 1) {
+    if (!(pending & 1)) continue;
+    uint16_t mask = 1 << bit;
+    if (changed & mask) rawInputChangedMs[bit] = timeNow;
+    else if ((uint16_t)(timeNow - rawInputChangedMs[bit]) >= DEBOUNCE_TIME) inputs ^= mask;
+  }
+  inputsPressed = inputs & ~previous;
+  inputsReleased = previous & ~inputs;
+}
+
+bool isPressed(uint16_t input) { return inputs & input; }
+bool wasPressed(uint16_t input) { return inputsPressed & input; }
+bool wasReleased(uint16_t input) { return inputsReleased & input; }
 
 void readInput() {
-  bool button1 = !digitalRead(BUTTON1_PIN);
-  if (button1) {
+  if (isPressed(INPUT_BUTTON1)) {
     showBootInfo = false;
   }
 
-  bool modeChangeBtn = !digitalRead(BUTTON2_PIN);
-  if (modeChangeBtn != modeChangePressed) {
-    if(modeChangeBtn) {
-      displayMode = (displayMode + 1) % 3;
-      saveEeprom();
-      Serial.println(displayMode);
-    }
+  if (wasPressed(INPUT_BUTTON2)) {
+    displayMode = (displayMode + 1) % 3;
+    markDirty(FIELD_DISPLAY_MODE);
+    sendEvent(EVENT_DISPLAY_MODE, displayMode);
   }
-  modeChangePressed = modeChangeBtn;
-  bool forceRunBtn = !digitalRead(BUTTON7_PIN);
-  if(forceRunBtn != forceRunPressed) {
-    if(forceRunBtn) {
-      if(isWinter()) {
-        digitalWrite(OUT_HEATER_PIN, HIGH);
-      } else {
-        digitalWrite(OUT_PUMP_PIN, HIGH);
-      } 
-      
-      digitalWrite(LED_BUILTIN, HIGH);
+
+  if (wasPressed(INPUT_BUTTON7)) {
+    if(!isPumpSeason()) {
+      Hal::setHeaterDuty(HEATER_DUTY_MAX);
     } else {
-      digitalWrite(OUT_HEATER_PIN, heaterRunning ? HIGH: LOW);
-      digitalWrite(OUT_PUMP_PIN, pumpRunning ? HIGH: LOW);
-      updateBuiltinLed();
-    }
+      for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) Hal::setPumpDuty(zone, PUMP_DUTY_MAX);
+    } 
+    
+    Hal::setLed(true);
+  } else if (wasReleased(INPUT_BUTTON7)) {
+    Hal::setHeaterDuty(heater.windowDuty());
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) Hal::setPumpDuty(zone, zones[zone].pump.outputDuty);
+    updateBuiltinLed();
   }
-  forceRunPressed = forceRunBtn;
-
-  bool containerBtn = !digitalRead(BUTTON6_PIN);
 
-  if(containerBtn != resetContainerPressed && containerBtn) {
-     pumpedTotal = 0;
-     saveEeprom();
-  }
-  resetContainerPressed = containerBtn;
+  if (wasPressed(INPUT_BUTTON6)) resetPumpedTotal();
 
-  bool resetBtn = !digitalRead(BUTTON8_PIN);
-  if (resetBtn != resetButtonPressed && resetBtn) {
+  if (wasPressed(INPUT_BUTTON8)) {
     resetEEPROM();
     readEeprom();
+    assignTempSensors();
   }
-  resetButtonPressed = resetBtn;
-  bool backlightBtn = !digitalRead(BUTTON3_PIN);
-  if (backlightBtn != backlightButtonPressed && backlightBtn) {
+
+  if (wasPressed(INPUT_BUTTON3)) {
     backlightOn = !backlightOn;
-    if(backlightOn) {
-      lcd.backlight(); 
-    } else {
-      lcd.noBacklight();
-    }
+    Hal::setLcdBacklight(backlightOn);
   }
-  backlightButtonPressed = backlightBtn;
 
-  bool forceBtn = !digitalRead(BUTTON4_PIN);
-  if (forceBtn != forceStopPressed && forceBtn) {
-    forceStopStartedMs = timeNow;
-    wasForceStopped = true;
+  if (wasPressed(INPUT_BUTTON4)) forceStop();
+
+  readSensors(inputs);
+}
+
+// Heater on time is counted by the HAL, so the clock may be corrected while heating
+bool isOperating() { return anyPumpRunning(); }
+
+void manageAlarm() {
+  if (!CONFIG.alarm) return;
+  AlarmConditions conditions = alarmConditions();
+  conditions.bootInfo = showBootInfo;
+  if (alarmEvaluator.update(conditions)) {
+    invalidateLcd();
+    sendEvent(EVENT_ALARM, alarmEvaluator.running);
+#ifdef USE_UPLINK
+    sendUplinkAlarm(conditions);
+#endif
   }
-  forceStopPressed = forceBtn;
-  motionSns = digitalRead(MOTION_PIN);
-  if(motionSns) {
-    motionStopStartedMs = timeNow;
-    wasMotionStopped = true;
+}
+
+void alarmReason() {
+  Serial.println(leftWaterMl());
+  Serial.println(dryTooLong());
+  Serial.println(isWinter());
+  Serial.println(tempSensorFail());
+}
+
+
+static const uint8_t BOOT_STATS_LINES = 24 + 4;
+static const uint8_t BOOT_STATS_LINE_MAX = 40; // Bytes with the line end
+
+// Line of the statistics printed at boot, one per loop iteration
+void printStatsLine(uint8_t line) {
+  if (line < 24) Serial.println(statistics.day(line).pumpedMl);
+  else if (line == 24) Serial.println(F("Heater max duty, kp and ki in permille"));
+  else if (line == 25) Serial.println(heaterMaxDuty());
+  else if (line == 26) Serial.println(heaterKp);
+  else Serial.println(heaterKi);
+}
+volatile unsigned long millisAdd = 0;
+unsigned long myMillis() {
+  return millis() + millisAdd;
+}
+
+#ifdef USE_RTC_SQW
+// Seconds since EPOCH_OFFSET, counted from the 1 Hz RTC square wave.
+// Millisecond part is taken from myMillis() since the latest tick.
+volatile uint32_t rtcSeconds = 0;
+volatile unsigned long rtcTickMillis = 0;
+
+void onRtcTick() {
+  rtcSeconds++;
+  rtcTickMillis = myMillis();
+}
+
+// Boot does not wait for a tick. Until the first one the millisecond part counts
+// from here and readTimeNow() holds it at the end of the second, the tick then
+// starts it from zero.
+void initializeRtcSquareWave() {
+  Hal::enableRtcSquareWave();
+  rtcTickMillis = myMillis();
+
+  pinMode(RTC_SQW_PIN, INPUT_PULLUP); // SQW is open drain
+  attachInterrupt(digitalPinToInterrupt(RTC_SQW_PIN), onRtcTick, FALLING);
+
+  // Read again if a tick came during the read, it may be before or after it
+  while (true) {
+    uint32_t ticks = rtcSeconds;
+    uint32_t now = Hal::readRtc() - EPOCH_OFFSET;
+    noInterrupts();
+    bool ticked = rtcSeconds != ticks;
+    if (!ticked) rtcSeconds = now;
+    interrupts();
+    if (!ticked) return;
   }
+}
+#endif
+
+uint32_t readTimeNow() {
+#ifdef USE_RTC_SQW
+  noInterrupts();
+  uint32_t seconds = rtcSeconds;
+  unsigned long tickMillis = rtcTickMillis;
+  interrupts();
+  // Never let millisecond part overflow to the next second, so the time does not drift
+  unsigned long sinceTick = myMillis() - tickMillis;
+  if (sinceTick > 999) sinceTick = 999;
+  return seconds * 1000 + sinceTick;
+#else
+  return epochAtStart + myMillis();
+#endif
+}
+
+uint32_t counter = 0;
 
-  moisture1Percent = 100 - (uint16_t)((float)analogRead(IN_MOISTURE1_PIN)/ 1023. * 100);
-  waterLevel = digitalRead(WATER_LEVEL_PIN);
+// Loop profiler. Time spent in each stage of loop() is measured with micros(),
+// and total loop durations are collected into a histogram with power of two
+// buckets: bucket 0 is below 64 us, bucket i is below 64 << i us.
+static const uint8_t STAGE_CLOCK = 0;
+static const uint8_t STAGE_TEMPERATURE = 1;
+static const uint8_t STAGE_INPUT = 2;
+static const uint8_t STAGE_PUMP = 3;
+static const uint8_t STAGE_HEATER = 4;
+static const uint8_t STAGE_LCD = 5;
+static const uint8_t STAGE_EEPROM = 6;
+static const uint8_t STAGE_LOG = 7;
+static const uint8_t STAGE_COUNT = 8;
+
+const char STAGE_NAMES[STAGE_COUNT][7] PROGMEM = {"clock", "temp", "input", "pump", "heater", "lcd", "eeprom", "log"};
+
+static const uint8_t LOOP_HISTOGRAM_BUCKETS = 16; // Last bucket is 2 s and longer
+static const uint32_t WATCHDOG_TIME_US = 2000000; // WDTO_2S
+
+struct StageProfile {
+  uint32_t count;
+  uint32_t totalUs;
+  uint32_t maxUs;
+};
+
+// Breadcrumbs of the running loop iteration, in RAM that is not cleared at
+// startup. After a watchdog or external reset they tell where the loop was.
+// The stage is written at each stage transition, the rest once per iteration.
+static const uint8_t BREADCRUMB_LOOP = STAGE_COUNT; // Between stages
+static const uint8_t BREADCRUMB_BOOT = 16; // In setup(), or + deferred BOOT_* phase
+static const uint8_t BREADCRUMB_NONE = 0xFF; // Power on, RAM content is random
+static const uint8_t BREADCRUMB_HEATER = 1;
+static const uint8_t BREADCRUMB_PUMP = 2;
+static const uint16_t BREADCRUMB_MAGIC = 0xB7C3;
+
+struct Breadcrumbs {
+  uint16_t magic; // BREADCRUMB_MAGIC once written
+  uint8_t stage;
+  uint8_t outputs;
+  uint32_t loop;
+  uint32_t timeNow;
+};
+
+#if defined(__AVR_ATmega2560__)
+Breadcrumbs breadcrumbs __attribute__((section(".noinit")));
+uint8_t resetCause __attribute__((section(".noinit")));
+
+// MCUSR has to be read and cleared before the watchdog, still enabled after a
+// watchdog reset, fires again. Runs in the C runtime startup, before
+// constructors and setup().
+void saveResetCause() __attribute__((naked, used, section(".init3")));
+void saveResetCause() {
+  resetCause = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
 }
+#else
+Breadcrumbs breadcrumbs;
+uint8_t resetCause = 0;
+#endif
 
-void startHeat() {
-  Serial.println("startHeat");
-  heaterRunning = true;
-  heaterStartedMs = timeNow;
-  digitalWrite(OUT_HEATER_PIN, HIGH);
-  updateBuiltinLed();
+void leaveBreadcrumbs() {
+  uint8_t outputs = heater.running ? BREADCRUMB_HEATER : 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (zones[zone].pump.running) outputs |= BREADCRUMB_PUMP << zone;
+  }
+  breadcrumbs.outputs = outputs;
+  breadcrumbs.loop = counter;
+  breadcrumbs.timeNow = timeNow;
+  breadcrumbs.stage = BREADCRUMB_LOOP;
 }
 
-void stopHeat() {
-  Serial.println("stopHeat");
-  heaterRunning = false;
-  digitalWrite(OUT_HEATER_PIN, LOW);
-  heaterIdleStartedMs = timeNow;
-  uint32_t heaterTime = timeNow - heaterStartedMs;
-  heatStatistics[0] += heaterTime;
-  updateBuiltinLed();
-  saveEeprom();
+// Breadcrumbs left before this reset, taken at the start of setup()
+ResetRecord crashedReset;
+
+void takeBreadcrumbs() {
+  bool valid = breadcrumbs.magic == BREADCRUMB_MAGIC && !(resetCause & _BV(PORF));
+  crashedReset.cause = resetCause;
+  crashedReset.stage = valid ? breadcrumbs.stage : BREADCRUMB_NONE;
+  crashedReset.outputs = breadcrumbs.outputs;
+  crashedReset.loop = breadcrumbs.loop;
+  crashedReset.timeNow = breadcrumbs.timeNow;
+  memset(&breadcrumbs, 0, sizeof(breadcrumbs));
+  breadcrumbs.magic = BREADCRUMB_MAGIC;
+  breadcrumbs.stage = BREADCRUMB_BOOT;
 }
 
-void updateBuiltinLed() {
-   digitalWrite(LED_BUILTIN, (heaterRunning || pumpRunning) ? HIGH: LOW);
+// The stock Mega bootloader clears MCUSR and disables the watchdog before
+// starting the sketch, so a watchdog reset often leaves no WDRF. Breadcrumbs
+// left inside a stage without power on, brown-out or external reset bits are
+// taken as a crash too. Opening the serial port resets the board through DTR,
+// which mostly hits the loop between stages or asleep, and with MCUSR kept an
+// external reset never replaces the crash being looked for.
+bool isCrash(const ResetRecord &reset) {
+  if (reset.stage == BREADCRUMB_NONE) return false;
+  if (reset.cause & _BV(WDRF)) return true;
+  return !(reset.cause & (_BV(PORF) | _BV(BORF) | _BV(EXTRF))) && reset.stage < STAGE_COUNT;
 }
 
-void startPump() {
-  pumpRunning = true;
-  pumpStartedMs = timeNow;
-  digitalWrite(OUT_PUMP_PIN, HIGH);
-  updateBuiltinLed();
-  resetMaxWaterLevel();
-  saveEeprom();
+// Report the reset and persist a crash, after the journal has been read
+void recordReset() {
+  sendEvent(EVENT_RESET, crashedReset.cause | (uint16_t)crashedReset.stage << 8);
+  if (!isCrash(crashedReset)) return;
+  uint8_t watchdogResets = lastReset.watchdogResets;
+  if (watchdogResets < 0xFF) watchdogResets++;
+  lastReset = crashedReset;
+  lastReset.watchdogResets = watchdogResets;
+  markDirty(FIELD_LAST_RESET);
+  markDirty(FIELD_RESET_LOOP);
+  markDirty(FIELD_RESET_TIME);
 }
 
-void stopPump() {
-  pumpRunning = false;
-  digitalWrite(OUT_PUMP_PIN, LOW);
-  updateBuiltinLed();
-  uint32_t pumped = msToMl(timeNow - pumpStartedMs);
-  pumpStatistics[0] += pumped; 
-  pumpedTotal += pumped;
-  idleStartedMs = timeNow;
-  saveEeprom();
+StageProfile stageProfiles[STAGE_COUNT];
+uint32_t loopHistogram[LOOP_HISTOGRAM_BUCKETS];
+uint32_t loopMaxUs = 0;
+uint32_t loopStartedUs = 0;
+
+void endStage(uint8_t stage, uint32_t startedUs) {
+  uint32_t us = micros() - startedUs;
+  StageProfile &profile = stageProfiles[stage];
+  profile.count++;
+  profile.totalUs += us;
+  if (us > profile.maxUs) profile.maxUs = us;
 }
 
+void runStage(uint8_t stage, void (*function)()) {
+  uint32_t startedUs = micros();
+  breadcrumbs.stage = stage;
+  function();
+  breadcrumbs.stage = BREADCRUMB_LOOP;
+  endStage(stage, startedUs);
+}
 
-void updateMaxWaterLevel() {
-  if (waterLevel) {
-    maxWaterLevel = true;
+void endLoopProfile() {
+  uint32_t us = micros() - loopStartedUs;
+  if (us > loopMaxUs) loopMaxUs = us;
+  uint8_t bucket = 0;
+  for (uint32_t limit = 64; us >= limit && bucket < LOOP_HISTOGRAM_BUCKETS - 1; limit <<= 1) {
+    bucket++;
   }
+  loopHistogram[bucket]++;
 }
 
-void resetMaxWaterLevel() {
-  maxWaterLevel = waterLevel;
+void resetProfile() {
+  memset(stageProfiles, 0, sizeof(stageProfiles));
+  memset(loopHistogram, 0, sizeof(loopHistogram));
+  loopMaxUs = 0;
+  counter = 0;
 }
 
-bool stopPumpTimePassed() { return timeNow - pumpStartedMs > PUMP_TIME;}
-bool idleTimePassed() { return timeNow - idleStartedMs > IDLE_TIME; }
-bool wetRecently() { return wasWet && (timeNow - lastWetMs < WET_TIME); }
-bool dryTooLong() { return timeNow - lastWetMs > DRY_TOO_LONG_TIME; }
+// Text reports asked with a single character, see readTextCommand(). Sent a
+// line per loop iteration through serial output like telemetry.
+static const uint8_t REPORT_NONE = 0;
+static const uint8_t REPORT_PROFILE = 1;
+static const uint8_t REPORT_MEMORY = 2;
 
-bool forceStoppedRecently() { return wasForceStopped && (timeNow - forceStopStartedMs < FORCE_STOP_TIME); }
-bool motionStoppedRecently() { return wasMotionStopped && (timeNow - motionStopStartedMs < MOTION_STOP_TIME); }
+uint8_t reportShown = REPORT_NONE;
+uint8_t reportLine = 0; // Next line of reportShown
 
-bool stopHeaterTimePassed() { return timeNow - heaterStartedMs > HEATER_ON_TIME; }
-bool heaterIdleTimePassed() { return timeNow - heaterIdleStartedMs > HEATER_IDLE_TIME; }
-bool isTriggerTemp() { return temperature < TEMP_LIMIT; }
-bool isAlarmTemp() { return temperature < TEMP_ALARM_LOW; }
-bool isOperating() { return pumpRunning || heaterRunning; }
-bool isWinter() { return true; }
+void showReport(uint8_t report) {
+  reportShown = report;
+  reportLine = 0;
+}
 
-bool cantStart() { return isWinter() || isTriggerTemp() || wetRecently() || forceStoppedRecently() || motionStoppedRecently(); }
+// Lines: header, stages, header, loop histogram, totals, header, boot phases
+uint8_t profileLines() { return 1 + STAGE_COUNT + 1 + LOOP_HISTOGRAM_BUCKETS + 5 + bootPhase; }
+
+// Line of profile into out, returns its length. Empty histogram buckets are 0.
+uint8_t formatProfileLine(char *out, uint8_t line) {
+  if (line == 0) return strlen(strcpy_P(out, PSTR("stage count avg_us max_us\n")));
+  line--;
+  if (line < STAGE_COUNT) {
+    const StageProfile &profile = stageProfiles[line];
+    strcpy_P(out, STAGE_NAMES[line]);
+    uint8_t length = strlen(out);
+    return length + snprintf_P(out + length, SERIAL_OUT_SIZE - length, PSTR(" %lu %lu %lu\n"),
+      (unsigned long)profile.count, (unsigned long)(profile.count ? profile.totalUs / profile.count : 0),
+      (unsigned long)profile.maxUs);
+  }
+  line -= STAGE_COUNT;
+  if (line == 0) return strlen(strcpy_P(out, PSTR("loop_below_us count\n")));
+  line--;
+  if (line < LOOP_HISTOGRAM_BUCKETS) {
+    if (!loopHistogram[line]) return 0;
+    return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("%lu %lu\n"), 64UL << line, (unsigned long)loopHistogram[line]);
+  }
+  line -= LOOP_HISTOGRAM_BUCKETS;
+  switch (line) {
+    case 0: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("loops %lu\n"), (unsigned long)counter);
+    case 1: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("loop_max_us %lu\n"), (unsigned long)loopMaxUs);
+    case 2:
+      return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("watchdog_margin_us %ld\n"),
+        (long)(int32_t)(WATCHDOG_TIME_US - loopMaxUs));
+    case 3:
+      return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("telemetry_dropped %lu\n"), (unsigned long)telemetryDroppedTotal);
+    case 4: return strlen(strcpy_P(out, PSTR("boot_phase done_us\n")));
+  }
+  line -= 5;
+  strcpy_P(out, BOOT_PHASE_NAMES[line]);
+  uint8_t length = strlen(out);
+  return length + snprintf_P(out + length, SERIAL_OUT_SIZE - length, PSTR(" %lu\n"), (unsigned long)bootPhaseUs[line]);
+}
+
+// Memory report. Free RAM between heap and stack is painted at boot, so the
+// deepest stack reached since is where the paint starts to be intact.
+#if defined(__AVR_ATmega2560__)
+extern uint8_t __data_start, __heap_start, *__brkval; // avr-libc
+
+static const uint8_t STACK_PAINT = 0xC5;
+static const uint8_t STACK_PAINT_MARGIN = 16; // Below the stack of paintStack()
+
+uint8_t *heapEnd() { return __brkval ? __brkval : &__heap_start; }
+
+void paintStack() {
+  uint8_t top; // Current end of stack
+  for (uint8_t *p = heapEnd(); p < &top - STACK_PAINT_MARGIN; p++) *p = STACK_PAINT;
+}
+
+// Bytes never used by stack or heap since boot
+uint16_t stackNeverUsed() {
+  uint8_t top;
+  uint8_t *p = heapEnd();
+  while (p < &top && *p == STACK_PAINT) p++;
+  return p - heapEnd();
+}
 
-void manageWaterPump() {
-  updateMaxWaterLevel();
+static const uint8_t MEMORY_LINES = 4;
 
-  if (maxWaterLevel) {
-    lastWetMs = timeNow;
-    wasWet = true;
+// Line of memory report into out, returns its length
+uint8_t formatMemoryLine(char *out, uint8_t line) {
+  uint8_t top;
+  switch (line) {
+    case 0: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("ram_static %u\n"), (unsigned)(&__heap_start - &__data_start));
+    case 1: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("heap %u\n"), (unsigned)(heapEnd() - &__heap_start));
+    case 2: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("free_now %u\n"), (unsigned)(&top - heapEnd()));
+    default: return snprintf_P(out, SERIAL_OUT_SIZE, PSTR("free_min %u\n"), stackNeverUsed());
   }
+}
+#else
+static const uint8_t MEMORY_LINES = 0;
+
+void paintStack() {}
+uint8_t formatMemoryLine(char*, uint8_t) { return 0; }
+#endif
 
-  if (pumpRunning) {
-    if (stopPumpTimePassed() || cantStart()) {
-      stopPump();
+// Next line of the shown report into serial output, false when it has ended
+bool formatReportLine() {
+  while (reportShown != REPORT_NONE) {
+    bool profile = reportShown == REPORT_PROFILE;
+    if (reportLine >= (profile ? profileLines() : MEMORY_LINES)) {
+      reportShown = REPORT_NONE;
+      break;
     }
-  } else if (idleTimePassed()) {
-    if (!maxWaterLevel && !cantStart()) {
-      startPump();
-    } else {
-      resetMaxWaterLevel();
-      idleStartedMs = timeNow;
+    uint8_t line = reportLine++;
+    char *out = (char*)serialOut;
+    serialOutLength = profile ? formatProfileLine(out, line) : formatMemoryLine(out, line);
+    serialOutSent = 0;
+    if (serialOutLength) return true;
+  }
+  return false;
+}
+
+#ifdef USE_SENSOR_LOG
+static const uint16_t SENSOR_LOG_SIZE = 32768; // MB85RC256V
+
+SensorLog<Hal, SENSOR_LOG_SIZE> sensorLog;
+
+void logSample() {
+  // Moisture and water level are of zone 0, pump flag is set when any pump runs
+  uint8_t flags = (zones[0].waterLevel ? SAMPLE_WATER_LEVEL : 0) | (motionSns ? SAMPLE_MOTION : 0) |
+    (anyPumpRunning() ? SAMPLE_PUMP : 0) | (heater.running ? SAMPLE_HEATER : 0) |
+    (tempSensorFail() ? SAMPLE_SENSOR_FAIL : 0);
+  sensorLog.add(secondsNow + EPOCH_OFFSET, temperature, zones[0].moisturePercent, flags);
+  schedule(TASK_LOG, timeNow + logInterval * ONE_SECOND);
+}
+
+void flushSensorLog() { sensorLog.flush(); }
+#endif
+
+// Binary protocol. Frames are
+//   0x7E, command, payload length, payload, checksum
+// where checksum is the 8 bit sum of command, length and payload bytes.
+// Replies use the same framing, with command CMD_REPLY | request command, or
+// CMD_ERROR. Values are little-endian. Bytes outside a frame are single
+// character text commands: 'p' prints profile, 'r' resets it.
+static const uint8_t FRAME_SYNC = 0x7E;
+static const uint8_t FRAME_OVERHEAD = 4;
+static const uint8_t FRAME_MAX_REQUEST = 8; // Longest accepted request payload
+static const uint16_t FRAME_TIMEOUT = 200; // Partial frame is dropped after this many ms
+
+static const uint8_t CMD_GET_STATE = 0x01; // Reply: see replyState()
+static const uint8_t CMD_GET_STATISTICS = 0x02; // Payload: STATISTICS_*, first bucket. Reply: see replyStatistics()
+static const uint8_t CMD_GET_TUNABLE = 0x03; // Payload: TUNABLE_*. Reply: id, int32 value
+static const uint8_t CMD_SET_TUNABLE = 0x04; // Payload: TUNABLE_*, int32 value. Reply as get
+static const uint8_t CMD_GET_LOG_INDEX = 0x05; // Payload: first block. Reply: see replyLogIndex()
+static const uint8_t CMD_GET_LOG_BLOCK = 0x06; // Payload: block, part. Reply: see replyLogBlock()
+static const uint8_t CMD_GET_RESET = 0x07; // Reply: see replyReset()
+static const uint8_t CMD_ERROR = 0x7F; // Payload: request command, ERROR_*
+static const uint8_t CMD_REPLY = 0x80;
+
+static const uint8_t ERROR_UNKNOWN_COMMAND = 1;
+static const uint8_t ERROR_BAD_LENGTH = 2;
+static const uint8_t ERROR_UNKNOWN_TUNABLE = 3;
+static const uint8_t ERROR_OUT_OF_RANGE = 4;
+static const uint8_t ERROR_NOT_AVAILABLE = 5;
+
+// Tunable ids, each persisted in its journal field of TUNABLE_FIELDS
+static const uint8_t TUNABLE_TEMP_LIMIT = 0; // Hundredths of celsius
+static const uint8_t TUNABLE_PUMP_PORTION = 1; // ml
+static const uint8_t TUNABLE_PERIOD_TIME = 2; // ms
+static const uint8_t TUNABLE_LOG_INTERVAL = 3; // s
+static const uint8_t TUNABLE_MOISTURE_LIMIT = 4; // Percent, 0 disables
+static const uint8_t TUNABLE_HEATER_SENSOR = 5; // Probe number, TEMP_SENSOR_MIN for the lowest
+static const uint8_t TUNABLE_HEATER_KP = 6; // Duty permille per celsius
+static const uint8_t TUNABLE_HEATER_KI = 7; // Duty permille per celsius hour
+static const uint8_t TUNABLE_PUMP_DUTY = 8; // Percent
+static const uint8_t TUNABLE_PUMP_FLOW = 9; // ml per 100 s, 4 points from 25 to 100 % duty
+static const uint8_t TUNABLE_COUNT = TUNABLE_PUMP_FLOW + PUMP_FLOW_POINTS;
+
+const uint8_t TUNABLE_FIELDS[TUNABLE_COUNT] = {
+  FIELD_TEMP_LIMIT, FIELD_PUMP_PORTION, FIELD_PERIOD_TIME,
+  FIELD_LOG_INTERVAL, FIELD_MOISTURE_LIMIT, FIELD_HEATER_SENSOR, FIELD_HEATER_KP, FIELD_HEATER_KI,
+  FIELD_PUMP_DUTY, FIELD_PUMP_FLOW, FIELD_PUMP_FLOW + 1, FIELD_PUMP_FLOW + 2, FIELD_PUMP_FLOW + 3,
+};
+
+uint8_t tunableField(uint8_t id) { return TUNABLE_FIELDS[id]; }
+bool isTunable(uint8_t id) { return id < TUNABLE_COUNT; }
+
+static const uint8_t FRAME_IDLE = 0;
+static const uint8_t FRAME_COMMAND = 1;
+static const uint8_t FRAME_LENGTH = 2;
+static const uint8_t FRAME_PAYLOAD = 3;
+static const uint8_t FRAME_CHECKSUM = 4;
+
+uint8_t frameState = FRAME_IDLE;
+uint8_t frameCommand = 0;
+uint8_t frameLength = 0;
+uint8_t frameReceived = 0;
+uint8_t frameSum = 0;
+uint8_t framePayload[FRAME_MAX_REQUEST];
+uint32_t frameStartedMs = 0;
+bool frameReady = false; // Complete request waiting for serial output to be free
+
+int32_t getTunable(uint8_t id) {
+  switch (id) {
+    case TUNABLE_TEMP_LIMIT: return tempLimit;
+    case TUNABLE_PUMP_PORTION: return pumpPortion;
+    case TUNABLE_PERIOD_TIME: return periodTime;
+    case TUNABLE_LOG_INTERVAL: return logInterval;
+    case TUNABLE_MOISTURE_LIMIT: return moistureLimit;
+    case TUNABLE_HEATER_SENSOR: return heaterSensor;
+    case TUNABLE_HEATER_KP: return heaterKp;
+    case TUNABLE_HEATER_KI: return heaterKi;
+    case TUNABLE_PUMP_DUTY: return pumpDuty;
+  }
+  if (id >= TUNABLE_PUMP_FLOW && id < TUNABLE_PUMP_FLOW + PUMP_FLOW_POINTS) return pumpFlow.flow[id - TUNABLE_PUMP_FLOW];
+  return 0;
+}
+
+// Returns false when value is out of range, the tunable is then not changed
+bool setTunable(uint8_t id, int32_t value) {
+  switch (id) {
+    case TUNABLE_TEMP_LIMIT:
+      if (value < -2000 || value > 3000) return false;
+      tempLimit = value;
+      break;
+    case TUNABLE_PUMP_PORTION:
+      if (value < 1 || value > 1000 || pumpFlow.runTimeMs(pumpDutyPwm(), value) >= periodTime) return false;
+      pumpPortion = value;
+      break;
+    case TUNABLE_PERIOD_TIME:
+      if (value <= (int32_t)pumpTime() || value > (int32_t)(24*ONE_HOUR)) return false;
+      periodTime = value;
+      break;
+    case TUNABLE_LOG_INTERVAL:
+      if (value < 1 || value > 3600) return false;
+      logInterval = value;
+      if (isArmed(TASK_LOG)) schedule(TASK_LOG, timeNow + logInterval * ONE_SECOND);
+      break;
+    case TUNABLE_MOISTURE_LIMIT:
+      if (value < 0 || value > 100) return false;
+      moistureLimit = value;
+      break;
+    case TUNABLE_HEATER_SENSOR:
+      if (value < 0 || value > TEMP_SENSOR_MIN) return false;
+      heaterSensor = value;
+      temperatureFail = !heaterTemperature(temperature);
+      if (temperatureFail) temperature = tempLimit + 100;
+      break;
+    case TUNABLE_HEATER_KP:
+      if (value < 0 || value > HEATER_PERMILLE) return false;
+      heaterKp = value;
+      break;
+    case TUNABLE_HEATER_KI:
+      if (value < 0 || value > HEATER_PERMILLE) return false;
+      heaterKi = value;
+      break;
+    case TUNABLE_PUMP_DUTY: {
+      if (value < 25 || value > 100) return false;
+      uint8_t previous = pumpDuty;
+      pumpDuty = value;
+      if (pumpTime() >= periodTime) {
+        pumpDuty = previous;
+        return false;
+      }
+      break;
+    }
+    default: {
+      // Flow calibration points, a portion must still fit into the period
+      if (id < TUNABLE_PUMP_FLOW || id >= TUNABLE_PUMP_FLOW + PUMP_FLOW_POINTS || value < 1 || value > 2000) return false;
+      uint16_t &flow = pumpFlow.flow[id - TUNABLE_PUMP_FLOW];
+      uint16_t previous = flow;
+      flow = value;
+      if (pumpTime() >= periodTime) {
+        flow = previous;
+        return false;
+      }
     }
   }
+  markDirty(tunableField(id));
+  applyTunables();
+  scheduleNow(TASK_PUMP);
+  scheduleNow(TASK_HEATER);
+  invalidateLcd();
+  return true;
+}
+
+void beginReply(uint8_t command) {
+  serialOut[0] = FRAME_SYNC;
+  serialOut[1] = command;
+  serialOutLength = 3;
+  serialOutSent = 0;
+}
+
+// AVR is little-endian, so values are copied as they are in memory
+void putReply(const void *data, uint8_t size) {
+  memcpy(serialOut + serialOutLength, data, size);
+  serialOutLength += size;
+}
+void putReply8(uint8_t value) { putReply(&value, 1); }
+
+void endReply() {
+  serialOut[2] = serialOutLength - 3;
+  uint8_t sum = 0;
+  for (uint8_t i = 1; i < serialOutLength; i++) sum += serialOut[i];
+  serialOut[serialOutLength++] = sum;
 }
 
-void manageHeater() {
-  if (heaterRunning) {
-    if(stopHeaterTimePassed()) stopHeat();
-  } else if (heaterIdleTimePassed() && isTriggerTemp()) { 
-    startHeat();
+void replyError(uint8_t command, uint8_t error) {
+  beginReply(CMD_ERROR);
+  putReply8(command);
+  putReply8(error);
+  endReply();
+}
+
+// uint32 unix time, int16 temperature, uint8 flags, uint8 display mode,
+// uint16 pumped total ml, uint32 ms since pump started, heater started and last wet,
+// uint16 filtered moisture reading, all of zone 0. Then uint8 zone count and for
+// each zone uint8 flags (bits 0, 2, 6 and 7 of the state flags), uint16 moisture,
+// uint32 ms since pump started and last wet and uint16 ml pumped today. Last
+// uint8 probe count and for each probe uint8 flags (bit 0 assigned, bit 1 not
+// answering) and int16 latest temperature, and uint16 heater duty in permille.
+void replyState() {
+  const Zone &zone = zones[0];
+  uint32_t unixTime = secondsNow + EPOCH_OFFSET;
+  uint8_t flags = zone.pump.running | heater.running << 1 | zone.waterLevel << 2 | motionSns << 3 |
+    alarmEvaluator.running << 4 | tempSensorFail() << 5 | cantStart(0) << 6 | zone.moistureWet << 7;
+  uint32_t sincePump = timeNow - zone.pump.startedMs;
+  uint32_t sinceHeater = timeNow - heater.startedMs;
+  uint32_t sinceWet = timeNow - zone.lastWetMs;
+  beginReply(CMD_REPLY | CMD_GET_STATE);
+  putReply(&unixTime, sizeof(unixTime));
+  putReply(&temperature, sizeof(temperature));
+  putReply8(flags);
+  putReply8(displayMode);
+  putReply(&statistics.pumpedTotal, sizeof(statistics.pumpedTotal));
+  putReply(&sincePump, sizeof(sincePump));
+  putReply(&sinceHeater, sizeof(sinceHeater));
+  putReply(&sinceWet, sizeof(sinceWet));
+  uint16_t moisture = Hal::readMoisture(0);
+  putReply(&moisture, sizeof(moisture));
+  putReply8(ZONE_COUNT);
+  for (uint8_t i = 0; i < ZONE_COUNT; i++) {
+    const Zone &z = zones[i];
+    putReply8(z.pump.running | z.waterLevel << 2 | cantStart(i) << 6 | z.moistureWet << 7);
+    moisture = Hal::readMoisture(i);
+    putReply(&moisture, sizeof(moisture));
+    sincePump = timeNow - z.pump.startedMs;
+    sinceWet = timeNow - z.lastWetMs;
+    putReply(&sincePump, sizeof(sincePump));
+    putReply(&sinceWet, sizeof(sinceWet));
+    putReply(&z.pumpedTodayMl, sizeof(z.pumpedTodayMl));
   }
+  putReply8(TEMP_SENSOR_COUNT);
+  for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+    const TempSensor &probe = tempSensors[sensor];
+    putReply8(isAssigned(sensor) | probe.fail << 1);
+    putReply(&probe.temperature, sizeof(probe.temperature));
+  }
+  putReply(&heater.duty, sizeof(heater.duty));
+  endReply();
 }
 
-void manageAlarm() {
-  float leftWater = (CONTAINER_SIZE - pumpedTotal)/1000.0;
-  alarmRunning = (!isWinter() && dryTooLong()) || showBootInfo || tempSensorFail || isAlarmTemp() || (!isWinter() && (leftWater < 7.5 && !forceStoppedRecently()));
+// uint8 MCUSR bits of the latest boot, then the persisted ResetRecord: uint8 cause,
+// stage and outputs, uint8 watchdog reset count, uint32 loop counter and timeNow
+void replyReset() {
+  beginReply(CMD_REPLY | CMD_GET_RESET);
+  putReply8(resetCause);
+  putReply(&lastReset, sizeof(lastReset));
+  endReply();
 }
 
-void alarmReason() {
-  float leftWater = (CONTAINER_SIZE - pumpedTotal)/1000.0;
-  Serial.println(leftWater);
-  Serial.println(dryTooLong());
-  Serial.println(isWinter());
-  Serial.println(tempSensorFail);
+static const uint8_t STATISTICS_PER_FRAME = 16;
+
+// uint8 resolution, uint8 first, uint8 count, then count buckets of uint32 pumped ml
+// and uint32 heater on seconds. First is how many buckets ago, open bucket is 0.
+// Whole history is read with consecutive requests until count is 0.
+void replyStatistics(uint8_t resolution, uint8_t first) {
+  uint8_t available = StatisticsStore<Hal>::bucketCount(resolution);
+  uint8_t count = first < available ? available - first : 0;
+  if (count > STATISTICS_PER_FRAME) count = STATISTICS_PER_FRAME;
+  beginReply(CMD_REPLY | CMD_GET_STATISTICS);
+  putReply8(resolution);
+  putReply8(first);
+  putReply8(count);
+  for (uint8_t i = 0; i < count; i++) {
+    StatisticsBucket bucket = statistics.bucket(resolution, first + i);
+    putReply(&bucket, sizeof(bucket));
+  }
+  endReply();
+}
+
+#ifdef USE_SENSOR_LOG
+static const uint8_t LOG_INDEX_PER_FRAME = 16;
+static const uint8_t LOG_PART_SIZE = 64;
+
+// uint8 next block to be written, uint8 block count, uint8 first, uint8 count, then
+// count x uint32 unix time of first sample of the block, 0 when block is not written
+void replyLogIndex(uint8_t first) {
+  uint8_t count = first < sensorLog.BLOCK_COUNT ? sensorLog.BLOCK_COUNT - first : 0;
+  if (count > LOG_INDEX_PER_FRAME) count = LOG_INDEX_PER_FRAME;
+  beginReply(CMD_REPLY | CMD_GET_LOG_INDEX);
+  putReply8(sensorLog.head);
+  putReply8(sensorLog.BLOCK_COUNT);
+  putReply8(first);
+  putReply8(count);
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t time = sensorLog.blockTime(first + i);
+    putReply(&time, sizeof(time));
+  }
+  endReply();
+}
+
+// uint8 block, uint8 part, then LOG_PART_SIZE bytes of the block: SensorSample
+// records, unused end of the block is 0xFF
+void replyLogBlock(uint8_t block, uint8_t part) {
+  uint8_t data[LOG_PART_SIZE];
+  sensorLog.readBlock(block, part * LOG_PART_SIZE, data, sizeof(data));
+  beginReply(CMD_REPLY | CMD_GET_LOG_BLOCK);
+  putReply8(block);
+  putReply8(part);
+  putReply(data, sizeof(data));
+  endReply();
+}
+#endif
+
+void replyTunable(uint8_t id) {
+  int32_t value = getTunable(id);
+  beginReply(CMD_REPLY | frameCommand);
+  putReply8(id);
+  putReply(&value, sizeof(value));
+  endReply();
+}
+
+// Handle received request, reply goes to serial output
+void handleFrame() {
+  frameReady = false;
+  uint8_t id = framePayload[0];
+  int32_t value;
+  switch (frameCommand) {
+    case CMD_GET_STATE:
+      replyState();
+      break;
+    case CMD_GET_RESET:
+      replyReset();
+      break;
+    case CMD_GET_STATISTICS:
+      if (frameLength != 2) replyError(frameCommand, ERROR_BAD_LENGTH);
+      else if (id > STATISTICS_MONTHLY) replyError(frameCommand, ERROR_OUT_OF_RANGE);
+      else replyStatistics(id, framePayload[1]);
+      break;
+#ifdef USE_SENSOR_LOG
+    case CMD_GET_LOG_INDEX:
+      if (frameLength != 1) replyError(frameCommand, ERROR_BAD_LENGTH);
+      else if (!sensorLog.present) replyError(frameCommand, ERROR_NOT_AVAILABLE);
+      else replyLogIndex(id);
+      break;
+    case CMD_GET_LOG_BLOCK:
+      if (frameLength != 2) replyError(frameCommand, ERROR_BAD_LENGTH);
+      else if (!sensorLog.present) replyError(frameCommand, ERROR_NOT_AVAILABLE);
+      else if (id >= sensorLog.BLOCK_COUNT || framePayload[1] >= SENSOR_LOG_BLOCK_SIZE / LOG_PART_SIZE) {
+        replyError(frameCommand, ERROR_OUT_OF_RANGE);
+      }
+      else replyLogBlock(id, framePayload[1]);
+      break;
+#endif
+    case CMD_GET_TUNABLE:
+      if (frameLength != 1) replyError(frameCommand, ERROR_BAD_LENGTH);
+      else if (!isTunable(id)) replyError(frameCommand, ERROR_UNKNOWN_TUNABLE);
+      else replyTunable(id);
+      break;
+    case CMD_SET_TUNABLE:
+      memcpy(&value, framePayload + 1, sizeof(value));
+      if (frameLength != 1 + sizeof(value)) replyError(frameCommand, ERROR_BAD_LENGTH);
+      else if (!isTunable(id)) replyError(frameCommand, ERROR_UNKNOWN_TUNABLE);
+      else if (!setTunable(id, value)) replyError(frameCommand, ERROR_OUT_OF_RANGE);
+      else replyTunable(id);
+      break;
+    default:
+      replyError(frameCommand, ERROR_UNKNOWN_COMMAND);
+  }
 }
 
+void readTextCommand(int command) {
+  if (command == 'p') showReport(REPORT_PROFILE);
+  else if (command == 'r') resetProfile();
+  else if (command == 'm') showReport(REPORT_MEMORY);
+}
 
-void printStats() {
-  for(uint16_t i = 0; i<24; i++) {
-    Serial.println(pumpStatistics[i]);
+// Parse received bytes incrementally. Reading stops when a complete request
+// waits for its turn in serial output, remaining bytes stay in receive buffer.
+void readSerialCommands() {
+  if (frameState != FRAME_IDLE && timeNow - frameStartedMs > FRAME_TIMEOUT) frameState = FRAME_IDLE;
+  while (!frameReady && Serial.available() > 0) {
+    uint8_t c = Serial.read();
+    switch (frameState) {
+      case FRAME_IDLE:
+        if (c == FRAME_SYNC) {
+          frameState = FRAME_COMMAND;
+          frameStartedMs = timeNow;
+        } else {
+          readTextCommand(c);
+        }
+        break;
+      case FRAME_COMMAND:
+        frameCommand = c;
+        frameSum = c;
+        frameState = FRAME_LENGTH;
+        break;
+      case FRAME_LENGTH:
+        frameLength = c;
+        frameSum += c;
+        frameReceived = 0;
+        memset(framePayload, 0, sizeof(framePayload));
+        if (frameLength > FRAME_MAX_REQUEST) frameState = FRAME_IDLE;
+        else frameState = frameLength ? FRAME_PAYLOAD : FRAME_CHECKSUM;
+        break;
+      case FRAME_PAYLOAD:
+        framePayload[frameReceived++] = c;
+        frameSum += c;
+        if (frameReceived == frameLength) frameState = FRAME_CHECKSUM;
+        break;
+      case FRAME_CHECKSUM:
+        frameReady = c == frameSum; // Corrupted frames are ignored
+        frameState = FRAME_IDLE;
+        break;
+    }
   }
 }
-uint32_t counter = 0;
+
+// Write as much of pending serial output as fits into transmit buffer. Requests
+// are replied before queued telemetry and telemetry before text reports, of
+// which one line is sent per call. Output is never mixed in the middle.
+void drainSerial() {
+  bool reported = false;
+  while (true) {
+    if (serialOutSent == serialOutLength) {
+      if (frameReady) handleFrame();
+      else if (telemetryCount) formatNextEvent();
+      else if (!reported && formatReportLine()) reported = true;
+      else return;
+    }
+    int room = Serial.availableForWrite();
+    if (room <= 0) return;
+    uint8_t length = serialOutLength - serialOutSent;
+    if (length > room) length = room;
+    Serial.write(serialOut + serialOutSent, length);
+    serialOutSent += length;
+  }
+}
+
 void setup() {
+  takeBreadcrumbs();
+  paintStack();
   wdt_enable(WDTO_2S);
-  Serial.begin(9600);
-  Wire.begin();
-  rtc.begin();
-  sensors.begin();
+  // After a watchdog reset pump and heater must be off before anything slow
+  Hal::begin();
+  endBootPhase(BOOT_OUTPUTS);
+
+  Serial.begin(TELEMETRY_BAUD);
+#ifdef USE_UPLINK
+  UPLINK_SERIAL.begin(UPLINK_BAUD);
+#endif
+  Hal::beginI2c();
 
-  if (!rtc.isrunning()) {
-    Serial.println("RTC is NOT running!");
-    rtc.adjust(DateTime(__DATE__, __TIME__));
+  if (!Hal::beginRtc()) {
+    Serial.println(F("RTC is NOT running!"));
   }
   //Serial.println(__TIME__);
   //rtc.adjust(DateTime(__DATE__, __TIME__));
   
-  dateTimeNow = rtc.now();
-  
-  dateTimeNow.tostr(lcdBuf1); 
-  Serial.println(lcdBuf1);
-  Serial.println(dateTimeNow.hour());
-  Serial.println(dateTimeNow.minute());
+  DateTime dateTime(Hal::readRtc());
   
-  epochAtStart = (uint64_t)(dateTimeNow.unixtime() - EPOCH_OFFSET) * 1000;
+  char dateTimeText[20]; // YYYY-MM-DD hh:mm:ss
+  dateTime.tostr(dateTimeText);
+  Serial.println(dateTimeText);
+  Serial.println(dateTime.hour());
+  Serial.println(dateTime.minute());
   
-  initializePins();
+  epochAtStart = (dateTime.unixtime() - EPOCH_OFFSET) * 1000;
+#ifdef USE_RTC_SQW
+  initializeRtcSquareWave();
+  secondsNow = rtcSeconds;
+#else
+  secondsNow = dateTime.unixtime() - EPOCH_OFFSET;
+#endif
+  secondsNowMs = secondsNow * 1000;
+  // Statistics read from EEPROM are rolled over on the first loop iteration
+  calendar.set(secondsNow + EPOCH_OFFSET);
+  calendarRolled = ROLLED_HOUR | ROLLED_DAY | ROLLED_MONTH;
+  timeNow = readTimeNow();
+  endBootPhase(BOOT_CLOCK);
+
+  heater.idleStartedMs = longAgo();
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) zones[zone].pump.zone = zone;
+  for (uint8_t task = 0; task < TASK_COUNT; task++) {
+    scheduleNow(task);
+  }
+  // Armed by continueBoot()
+  scheduleNever(TASK_TEMPERATURE);
+  scheduleNever(TASK_LCD);
+  scheduleNever(TASK_LOG);
+#ifdef USE_UPLINK
+  schedule(TASK_UPLINK, timeNow + UPLINK_INTERVAL);
+#else
+  scheduleNever(TASK_UPLINK);
+#endif
+
   readEeprom();
-  printStats();
-  lcd.init();
-  Serial.println("Heat params in seconds");
-  Serial.println(HEATER_ON_TIME);
-  Serial.println(HEATER_IDLE_TIME);
-  printBootInfo();
+  applyTunables();
+  ageTimestamps();
+  recordReset();
+  endBootPhase(BOOT_JOURNAL);
 }
 
-unsigned long millisAdd = 0;
-unsigned long myMillis() {
-  return millis() + millisAdd;
+uint8_t bootStatsLine = 0;
+
+#ifdef USE_SENSOR_LOG
+const char NO_FRAM_LINE[] PROGMEM = "No FRAM, sensor log disabled";
+#endif
+
+// Text line of length fits into transmit buffer, without cutting a frame
+bool serialLineFits(uint8_t length) {
+  return serialOutSent == serialOutLength && Serial.availableForWrite() >= length;
 }
 
-void loop() {
-  wdt_reset();
-  timeNow = epochAtStart + myMillis();
-  dateTimeNow.setunixtime((timeNow / 1000) + EPOCH_OFFSET);
-
-  if(dateTimeNow.day() != statisticsCurrentDay) {
-    dayPassed();
-    statisticsCurrentDay = dateTimeNow.day();
-    saveEeprom();
-  }
-
-  // We do not want to fix clock (because it might jump backwards) during operations.
-  // It would mess up time based volume etc. calculations
-  if (timeNow - lastTimeClockCorrected > FIFTEEN_MINUTES && !isOperating()) {    
-    int32_t correction = rtc.now().unixtime() - dateTimeNow.unixtime();
-    epochAtStart += correction * 1000;
-    timeNow = epochAtStart + myMillis();
-    lastTimeClockCorrected = timeNow;
-    saveEeprom();
-  }
-  if (timeNow - tempLastRead > 10000) {
-    sensors.requestTemperatures();
-    float temp = sensors.getTempCByIndex(0);
-    if (temp != DEVICE_DISCONNECTED_C) {
-      temperature = temp;
-      tempSensorFail = false;
+// Next deferred boot phase, called once per loop iteration after the control
+void continueBoot() {
+  breadcrumbs.stage = BREADCRUMB_BOOT + bootPhase;
+  switch (bootPhase) {
+    case BOOT_CONTROL:
+      return; // Finished in loop()
+    case BOOT_LCD:
+      Hal::beginLcd();
+      printBootInfo();
+      scheduleNow(TASK_LCD);
+      break;
+    case BOOT_SENSORS:
+      initializeTempSensor();
+      assignTempSensors();
+      scheduleNow(TASK_TEMPERATURE);
+      break;
+    case BOOT_LOG:
+#ifdef USE_SENSOR_LOG
+      // Failure is printed, only when it does not block on a full transmit buffer or cut a frame
+      if (!serialLineFits(sizeof(NO_FRAM_LINE) + 1)) return;
+      if (sensorLog.begin()) scheduleNow(TASK_LOG);
+      else Serial.println((const __FlashStringHelper*)NO_FRAM_LINE);
+#endif
+      break;
+    case BOOT_STATS:
+      if (!serialLineFits(BOOT_STATS_LINE_MAX)) return;
+      printStatsLine(bootStatsLine++);
+      if (bootStatsLine < BOOT_STATS_LINES) return;
+      break;
+  }
+  endBootPhase(bootPhase);
+}
+
+static const uint8_t RTC_READ_POLL_TIME = 2; // ms
+static const uint8_t RTC_READ_TIMEOUT = 100; // ms, retried a minute later
+bool rtcRequested = false;
+uint32_t rtcRequestedMs = 0;
+
+// We do not want to fix clock (because it might jump backwards) during operations.
+// It would mess up time based volume etc. calculations
+void correctClock() {
+#ifdef USE_RTC_SQW
+  // RTC square wave keeps the time, no need to correct
+  scheduleNever(TASK_CLOCK);
+  return;
+#endif
+  if (isOperating()) {
+    rtcRequested = false;
+    schedule(TASK_CLOCK, timeNow + ONE_SECOND);
+    return;
+  }
+  // Time is read in the background, see Hal::requestRtc()
+  if (!rtcRequested) {
+    Hal::requestRtc();
+    rtcRequested = true;
+    rtcRequestedMs = timeNow;
+  }
+  uint32_t rtcTime;
+  if (!Hal::rtcReady(rtcTime)) {
+    if (timeNow - rtcRequestedMs < RTC_READ_TIMEOUT) {
+      schedule(TASK_CLOCK, timeNow + RTC_READ_POLL_TIME);
     } else {
-      temperature = TEMP_LIMIT + 1;
-      tempSensorFail = true;
+      rtcRequested = false;
+      schedule(TASK_CLOCK, timeNow + ONE_MINUTE);
     }
-    tempLastRead = timeNow;
+    return;
+  }
+  rtcRequested = false;
+  int32_t correction = rtcTime - EPOCH_OFFSET - secondsNow;
+  epochAtStart += correction * 1000;
+  secondsNow += correction;
+  if (correction) calendarRolled |= calendar.set(secondsNow + EPOCH_OFFSET);
+  secondsNowMs += correction * 1000;
+  timeNow = readTimeNow();
+  lastTimeClockCorrected = timeNow;
+  schedule(TASK_CLOCK, lastTimeClockCorrected + FIFTEEN_MINUTES + 1);
+}
+
+#ifdef USE_LOWPOWER
+struct SleepPeriod {
+  period_t period;
+  uint16_t ms;
+};
+
+static const SleepPeriod SLEEP_PERIODS[] = {
+  {SLEEP_15MS, 15}, {SLEEP_30MS, 30}, {SLEEP_60MS, 60}, {SLEEP_120MS, 120}, {SLEEP_250MS, 250},
+  {SLEEP_500MS, 500}, {SLEEP_1S, 1000}, {SLEEP_2S, 2000}, {SLEEP_4S, 4000}, {SLEEP_8S, 8000}
+};
+
+// Sleep for the longest period that ends before the next task deadline
+void sleepUntilNextEvent() {
+  if (isBeeping() || isBooting()) return;
+  // Power down would stop the timer switching the heater and pump PWM and the
+  // I2C transfers and the uplink output, and water level is watched while
+  // pumping. Idle until next interrupt instead. Off part of the heater window
+  // is slept through, see Hal::heaterOffMs().
+  uint32_t heaterOffMs = Hal::heaterOffMs();
+  if (!heaterOffMs || anyPumpRunning() || !Hal::isBusIdle() || isUplinkSending()) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+    return;
+  }
+
+#ifdef USE_PIN_WAKE
+  // Change being debounced needs another sample soon
+  uint32_t pollTime = rawInputs != inputs ? DEBOUNCE_TIME : PIN_WAKE_POLL_TIME;
+  pinWake = false;
+  // Change after the latest sample would not wake us, it already happened
+  if (Hal::readInputs() != rawInputs) return;
+#else
+  uint32_t pollTime = INPUT_POLL_TIME;
+#endif
+  uint32_t sleepMs = timeToNextDeadline(pollTime < heaterOffMs ? pollTime : heaterOffMs);
+
+  int8_t chosen = -1;
+  for (uint8_t i = 0; i < sizeof(SLEEP_PERIODS) / sizeof(SLEEP_PERIODS[0]) && SLEEP_PERIODS[i].ms <= sleepMs; i++) {
+    chosen = i;
+  }
+  if (chosen < 0) return;
+
+#ifdef USE_RTC_SQW
+  uint32_t seconds = rtcSeconds;
+#endif
+  LowPower.powerDown(SLEEP_PERIODS[chosen].period, ADC_OFF, BOD_ON);
+  uint16_t sleptMs = SLEEP_PERIODS[chosen].ms;
+#ifdef USE_PIN_WAKE
+  // Woken up somewhere in the period. Take the middle and correct the clock
+  // from RTC soon, error is at most half of the period until then.
+  if (pinWake) {
+    sleptMs /= 2;
+    scheduleNow(TASK_CLOCK);
+  }
+#endif
+#ifdef USE_RTC_SQW
+  // If RTC tick woke us up, millisecond part has just started from zero
+  if (rtcSeconds == seconds)
+#endif
+  millisAdd += sleptMs;
+  // LowPower disables, so let's re-enable.
+  wdt_enable(WDTO_2S);
+  Hal::resumeAfterSleep(sleptMs);
+}
+#endif
+
+void loop() {
+  wdt_reset();
+  Hal::serviceBus();
+  loopStartedUs = micros();
+  timeNow = readTimeNow();
+  while (timeNow - secondsNowMs >= ONE_SECOND) {
+    secondsNowMs += ONE_SECOND;
+    secondsNow++;
+    calendarRolled |= calendar.tick();
+  }
+  leaveBreadcrumbs();
+  if (calendarRolled) rollOverCalendar();
+
+  if (taskDue(TASK_CLOCK)) runStage(STAGE_CLOCK, correctClock);
+
+  uint32_t inputStartedUs = micros();
+  breadcrumbs.stage = STAGE_INPUT;
+  sampleInputs();
+  if (inputsPressed || inputsReleased) {
+    scheduleNow(TASK_PUMP);
+    invalidateLcd();
   }
   readInput();
-  manageWaterPump();
-  manageHeater();
+  trackWaterLevel();
+  breadcrumbs.stage = BREADCRUMB_LOOP;
+  endStage(STAGE_INPUT, inputStartedUs);
+
+  if (taskDue(TASK_TEMPERATURE)) runStage(STAGE_TEMPERATURE, readTemperature);
+  if (taskDue(TASK_PUMP)) runStage(STAGE_PUMP, manageWaterPump);
+  if (taskDue(TASK_HEATER)) runStage(STAGE_HEATER, manageHeater);
+  if (bootPhase == BOOT_CONTROL) endBootPhase(BOOT_CONTROL);
   manageAlarm();
-  updateLcd();
-  manageBlink();
+  if (taskDue(TASK_LCD)) runStage(STAGE_LCD, updateLcd);
+  if (taskDue(TASK_BLINK)) manageBlink();
   updateBeeper();
   manageBuiltinLedBlink();
+  if (taskDue(TASK_EEPROM)) runStage(STAGE_EEPROM, flushEeprom);
+#ifdef USE_SENSOR_LOG
+  if (taskDue(TASK_LOG)) logSample();
+  if (sensorLog.isWriting()) runStage(STAGE_LOG, flushSensorLog);
+#endif
+#ifdef USE_UPLINK
+  if (taskDue(TASK_UPLINK)) sendUplinkReport();
+#endif
+  readSerialCommands();
+  drainSerial();
+#ifdef USE_UPLINK
+  drainUplink();
+#endif
   counter++;
-  if(false && counter % 100 == 0) {
-    Serial.println("speed");
-    Serial.println(counter);
-    Serial.println(myMillis());
-    Serial.println(1000*counter/myMillis());
-    Serial.flush();
-  }
+  endLoopProfile();
+  if (isBooting()) continueBoot();
   #ifdef USE_LOWPOWER
-  if(!isBeeping()) {
-    LowPower.powerDown(SLEEP_120MS, ADC_OFF, BOD_ON);
-    millisAdd += 120;
-    // LowPower disables, so let's re-enable.
-    wdt_enable(WDTO_2S);
-  }
+  sleepUntilNextEvent();
   #endif
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_SENSOR_LOG_H
+#define PULPUTIN_SENSOR_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Sensor history in a ring of fixed size blocks in FRAM, see hal.h. Samples
+// are staged in RAM and a full block is handed over to the writer, which writes
+// it in small chunks from consecutive loop iterations. Meanwhile new samples
+// go into the other staging buffer, so sampling never waits for storage.
+//
+// Storage starts with an index of uint32 unix time of the first sample of each
+// block, 0 for a block not written, and blocks follow. Time order of blocks is
+// the ring order, so a time range is found from the index alone.
+
+static const uint8_t SAMPLE_WATER_LEVEL = 1 << 0;
+static const uint8_t SAMPLE_MOTION = 1 << 1;
+static const uint8_t SAMPLE_PUMP = 1 << 2;
+static const uint8_t SAMPLE_HEATER = 1 << 3;
+static const uint8_t SAMPLE_SENSOR_FAIL = 1 << 4;
+
+struct SensorSample {
+  uint16_t offsetS; // Seconds since first sample of the block
+  int16_t temperature; // Hundredths of celsius
+  uint8_t moisture; // Percent
+  uint8_t flags; // SAMPLE_*
+};
+
+static const uint8_t SENSOR_LOG_BLOCK_SIZE = 128;
+static const uint8_t SENSOR_LOG_BLOCK_SAMPLES = SENSOR_LOG_BLOCK_SIZE / sizeof(SensorSample);
+static const uint8_t SENSOR_LOG_CHUNK = 16; // Bytes per write, fits into I2C buffer with the address
+
+static_assert(sizeof(SensorSample) == 6, "Sample is stored as it is");
+static_assert(SENSOR_LOG_BLOCK_SIZE % SENSOR_LOG_CHUNK == 0, "Block is written in whole chunks");
+
+template <class Hal, uint16_t Size>
+class SensorLog {
+public:
+  static const uint8_t BLOCK_COUNT = Size / (SENSOR_LOG_BLOCK_SIZE + 4);
+  static const uint16_t BLOCKS_START = BLOCK_COUNT * 4;
+
+  bool present = false;
+  uint8_t head = 0; // Next block to be written
+  uint16_t dropped = 0; // Samples lost because the writer was late
+
+  // Find the newest block from the index. Returns false if there is no storage.
+  bool begin() {
+    present = Hal::beginFram();
+    if (!present) return false;
+    uint32_t newestTime = 0;
+    for (uint8_t block = 0; block < BLOCK_COUNT; block++) {
+      uint32_t time = blockTime(block);
+      if (time && (int32_t)(time - newestTime) >= 0) {
+        newestTime = time;
+        head = (block + 1) % BLOCK_COUNT;
+      }
+    }
+    return true;
+  }
+
+  void add(uint32_t unixTime, int16_t temperature, uint8_t moisture, uint8_t flags) {
+    if (!present) return;
+    if (count == SENSOR_LOG_BLOCK_SAMPLES || (count && unixTime - firstTime[filling] > 0xFFFF)) {
+      if (!close()) {
+        dropped++;
+        return;
+      }
+    }
+    if (!count) firstTime[filling] = unixTime;
+    SensorSample sample;
+    sample.offsetS = unixTime - firstTime[filling];
+    sample.temperature = temperature;
+    sample.moisture = moisture;
+    sample.flags = flags;
+    memcpy(buffers[filling] + count * sizeof(sample), &sample, sizeof(sample));
+    count++;
+  }
+
+  bool isWriting() const { return writing; }
+
+  // Write next chunk of the block being written. Index entry is cleared before
+  // the first chunk and set after the last one, so only complete blocks are found.
+  void flush() {
+    if (!writing) return;
+    if (!written) {
+      uint32_t none = 0;
+      Hal::writeFram(indexAddress(writeBlock), &none, sizeof(none));
+    }
+    Hal::writeFram(blockAddress(writeBlock) + written, buffers[!filling] + written, SENSOR_LOG_CHUNK);
+    written += SENSOR_LOG_CHUNK;
+    if (written < SENSOR_LOG_BLOCK_SIZE) return;
+    Hal::writeFram(indexAddress(writeBlock), &firstTime[!filling], sizeof(firstTime[0]));
+    writing = false;
+  }
+
+  uint32_t blockTime(uint8_t block) const {
+    uint32_t time;
+    Hal::readFram(indexAddress(block), &time, sizeof(time));
+    return time;
+  }
+
+  void readBlock(uint8_t block, uint8_t offset, void *data, uint8_t size) const {
+    Hal::readFram(blockAddress(block) + offset, data, size);
+  }
+
+private:
+  uint8_t buffers[2][SENSOR_LOG_BLOCK_SIZE];
+  uint32_t firstTime[2];
+  uint8_t filling = 0; // Buffer receiving samples, the other one is written
+  uint8_t count = 0; // Samples in the filling buffer
+  bool writing = false;
+  uint8_t writeBlock = 0;
+  uint8_t written = 0; // Bytes of the block written
+
+  static uint16_t indexAddress(uint8_t block) { return block * 4; }
+  static uint16_t blockAddress(uint8_t block) { return BLOCKS_START + block * SENSOR_LOG_BLOCK_SIZE; }
+
+  // Hand filled buffer over to the writer, unused end is padded with 0xFF
+  bool close() {
+    if (writing) return false;
+    memset(buffers[filling] + count * sizeof(SensorSample), 0xFF, SENSOR_LOG_BLOCK_SIZE - count * sizeof(SensorSample));
+    writeBlock = head;
+    head = (head + 1) % BLOCK_COUNT;
+    written = 0;
+    writing = true;
+    filling = !filling;
+    count = 0;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,550 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+// Host simulation of the watering and heating control. Runs the control glue of
+// the sketch (unit.h), with its control classes, task scheduler and EEPROM
+// journal, against simulated hardware, so that months of operation take a few
+// seconds. See README.md for building and scenarios.
+//
+// Loop of pulputin.ino is mirrored by controlPass(). Simulated time advances
+// from one task deadline to the next, like the sleep of the sketch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "sim_hal.h"
+
+SimWorld world;
+
+typedef SimHal Hal;
+
+// Season and subsystems of the scenario, a constant of the build in pulputin.ino
+Config CONFIG = CONFIG_WINTER;
+
+#include "../unit.h"
+
+static const uint32_t ONE_DAY = 24 * ONE_HOUR;
+
+// Longest simulated step. Soil and temperature are continuous, this bounds
+// how late their changes are noticed.
+static const uint32_t MAX_STEP = 10 * ONE_SECOND;
+
+static const uint32_t SIM_START_UNIX_TIME = 1698796800; // 2023-11-01 00:00 UTC
+
+// Scenario
+
+static const uint8_t SCENARIO_TEMPERATURE = 0; // a: min, b: max celsius
+static const uint8_t SCENARIO_SENSOR = 1; // a: 1 fail, 0 ok
+static const uint8_t SCENARIO_PRESS = 2; // a: button 1-8
+static const uint8_t SCENARIO_MOTION = 3; // a: minutes
+static const uint8_t SCENARIO_REFILL = 4;
+
+struct ScenarioEvent {
+  uint64_t ms;
+  uint8_t type;
+  double a;
+  double b;
+};
+
+struct Scenario {
+  std::string name;
+  double days = 30;
+  Config config = CONFIG_WINTER;
+  double containerMl = CONTAINER_SIZE;
+  double soilWetMl = 300; // Water level sensor is wet when soil holds this much
+  double soilDrainMlPerHour = 20;
+  double tempMin = 5;
+  double tempMax = 15;
+  int16_t tempLimit = 500;
+  uint16_t heaterKp = 100;
+  uint16_t heaterKi = 100;
+  double heatingCPerW = 0; // Soil warming at steady heater power, 0 when heater does not affect sensor
+  double heatingHours = 1; // Time constant of soil temperature
+  uint16_t pumpPortion = 100;
+  uint8_t pumpDuty = 100;
+  PumpFlow pumpFlow = {{30, 60, 88, 106}}; // Calibration of the firmware
+  PumpFlow trueFlow; // Flow of the simulated pump, the calibration unless set
+  bool trueFlowSet = false;
+  uint32_t periodTime = 15 * ONE_MINUTE;
+  uint8_t moistureLimit = 0;
+  std::vector<ScenarioEvent> events;
+};
+
+void fail(const char *file, int line, const char *message) {
+  fprintf(stderr, "%s:%d: %s\n", file, line, message);
+  exit(1);
+}
+
+// Flow points after the first one or two words of the line
+bool readFlow(const char *buf, bool tunable, PumpFlow &flow) {
+  uint16_t *f = flow.flow;
+  const char *format = tunable ? "%*s %*s %hu %hu %hu %hu" : "%*s %hu %hu %hu %hu";
+  return sscanf(buf, format, &f[0], &f[1], &f[2], &f[3]) == PUMP_FLOW_POINTS;
+}
+
+bool loadScenario(const char *file, Scenario &scenario) {
+  FILE *f = fopen(file, "r");
+  if (!f) return false;
+  scenario.name = file;
+  char buf[256];
+  int line = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    line++;
+    char *comment = strchr(buf, '#');
+    if (comment) *comment = 0;
+    char word[32], arg[32];
+    double a = 0, b = 0, day = 0;
+    int n = sscanf(buf, "%31s", word);
+    if (n < 1) continue;
+    if (!strcmp(word, "days") && sscanf(buf, "%*s %lf", &a) == 1) scenario.days = a;
+    else if (!strcmp(word, "season") && sscanf(buf, "%*s %31s", arg) == 1) {
+      if (!strcmp(arg, "winter")) scenario.config = CONFIG_WINTER;
+      else if (!strcmp(arg, "summer")) scenario.config = CONFIG_SUMMER;
+      else if (!strcmp(arg, "auto")) scenario.config = CONFIG_SEASONAL;
+      else fail(file, line, "unknown season");
+    }
+    else if (!strcmp(word, "container") && sscanf(buf, "%*s %lf", &a) == 1) scenario.containerMl = a;
+    else if (!strcmp(word, "soil") && sscanf(buf, "%*s %lf %lf", &a, &b) == 2) {
+      scenario.soilWetMl = a;
+      scenario.soilDrainMlPerHour = b;
+    } else if (!strcmp(word, "temperature") && sscanf(buf, "%*s %lf %lf", &a, &b) == 2) {
+      scenario.tempMin = a;
+      scenario.tempMax = b;
+    } else if (!strcmp(word, "heating") && sscanf(buf, "%*s %lf %lf", &a, &b) == 2) {
+      scenario.heatingCPerW = a;
+      scenario.heatingHours = b;
+    } else if (!strcmp(word, "tunable") && sscanf(buf, "%*s %31s %lf", arg, &a) == 2) {
+      if (!strcmp(arg, "temp_limit")) scenario.tempLimit = lround(a * 100);
+      else if (!strcmp(arg, "heater_kp")) scenario.heaterKp = a;
+      else if (!strcmp(arg, "heater_ki")) scenario.heaterKi = a;
+      else if (!strcmp(arg, "pump_portion")) scenario.pumpPortion = a;
+      else if (!strcmp(arg, "period_time")) scenario.periodTime = a * ONE_MINUTE;
+      else if (!strcmp(arg, "moisture_limit")) scenario.moistureLimit = a;
+      else if (!strcmp(arg, "pump_duty")) scenario.pumpDuty = a;
+      else if (!strcmp(arg, "pump_flow") && readFlow(buf, true, scenario.pumpFlow)) {}
+      else fail(file, line, "unknown tunable");
+    } else if (!strcmp(word, "flow") && readFlow(buf, false, scenario.trueFlow)) {
+      scenario.trueFlowSet = true;
+    } else if (!strcmp(word, "at") && sscanf(buf, "%*s %lf %31s", &day, arg) == 2) {
+      ScenarioEvent event;
+      event.ms = day * ONE_DAY;
+      event.a = event.b = 0;
+      if (!strcmp(arg, "temperature") && sscanf(buf, "%*s %*s %*s %lf %lf", &event.a, &event.b) == 2) event.type = SCENARIO_TEMPERATURE;
+      else if (!strcmp(arg, "sensor") && sscanf(buf, "%*s %*s %*s %31s", word) == 1) {
+        event.type = SCENARIO_SENSOR;
+        event.a = !strcmp(word, "fail");
+      }
+      else if (!strcmp(arg, "press") && sscanf(buf, "%*s %*s %*s %lf", &event.a) == 1) event.type = SCENARIO_PRESS;
+      else if (!strcmp(arg, "motion") && sscanf(buf, "%*s %*s %*s %lf", &event.a) == 1) event.type = SCENARIO_MOTION;
+      else if (!strcmp(arg, "refill")) event.type = SCENARIO_REFILL;
+      else fail(file, line, "bad event");
+      scenario.events.push_back(event);
+    } else {
+      fail(file, line, "syntax error");
+    }
+  }
+  fclose(f);
+  if (!scenario.trueFlowSet) scenario.trueFlow = scenario.pumpFlow;
+  std::stable_sort(scenario.events.begin(), scenario.events.end(),
+    [](const ScenarioEvent &x, const ScenarioEvent &y) { return x.ms < y.ms; });
+  return true;
+}
+
+// Report
+
+struct AlarmChange {
+  uint64_t ms;
+  bool on;
+};
+
+struct Report {
+  uint32_t passes = 0;
+  double passTotalNs = 0;
+  double passMaxNs = 0;
+  double wallSeconds = 0;
+  uint32_t pumpRuns = 0;
+  uint32_t heaterRuns = 0;
+  double pumpOnMs = 0;
+  double heaterOnMs = 0;
+  double soilMl = 0; // Water that reached the soil
+  double dryMl = 0; // Pumped while container was empty
+  uint32_t bootBlockWrites = 0;
+  std::vector<AlarmChange> alarms;
+};
+
+Report report;
+
+// Firmware state and functions that unit.h leaves to pulputin.ino
+
+Journal<SimHal, FIELD_COUNT> journal(EEPROM_JOURNAL_START, SIM_EEPROM_SIZE, unitFieldData);
+
+uint16_t previousInputs = 0;
+
+void sendZoneEvent(uint8_t type, uint8_t, int32_t) {
+  if (type == EVENT_PUMP_START) report.pumpRuns++;
+  else if (type == EVENT_HEATER_START) report.heaterRuns++;
+}
+
+void invalidateLcd() {}
+
+uint32_t unixTimeNow() { return world.startUnixTime + world.ms / 1000; }
+
+uint32_t currentHour() { return unixTimeNow() / 3600; }
+uint16_t currentDay() { return unixTimeNow() / 86400; }
+
+// Same as Calendar::monthNumber() in pulputin.ino
+uint16_t currentMonth() {
+  time_t t = unixTimeNow();
+  struct tm date;
+  gmtime_r(&t, &date);
+  return (date.tm_year + 1900) * 12 + date.tm_mon;
+}
+
+// One pass of loop() in pulputin.ino: inputs, temperature, pump, heater, alarm, EEPROM
+void controlPass() {
+  // Calendar of the sketch crosses a day or month boundary only with an hour boundary
+  if (currentHour() != statistics.hourNumber) rollOverStatistics();
+
+  // Inputs do not bounce in the simulation
+  if (world.inputs != previousInputs) scheduleNow(TASK_PUMP);
+  previousInputs = world.inputs;
+  readSensors(world.inputs);
+  trackWaterLevel();
+
+  if (taskDue(TASK_TEMPERATURE)) readTemperature();
+  if (taskDue(TASK_PUMP)) manageWaterPump();
+  if (taskDue(TASK_HEATER)) manageHeater();
+  if (CONFIG.alarm && alarmEvaluator.update(alarmConditions())) {
+    AlarmChange change = {world.ms, alarmEvaluator.running};
+    report.alarms.push_back(change);
+  }
+  if (taskDue(TASK_EEPROM)) flushEeprom();
+}
+
+// Milliseconds until the next deadline of the firmware, at least one. Like the
+// loop of the sketch, a pass due at once follows a millisecond later.
+uint32_t nextDeadline() {
+  uint32_t next = timeToNextDeadline(MAX_STEP);
+  return next ? next : 1;
+}
+
+double scenarioTemperature(const Scenario &scenario, uint64_t ms) {
+  // Coldest at 04:00, warmest at 16:00
+  double hour = (double)(ms % ONE_DAY) / ONE_HOUR;
+  double phase = (1 - cos((hour - 4) / 24 * 2 * M_PI)) / 2;
+  return scenario.tempMin + (scenario.tempMax - scenario.tempMin) * phase;
+}
+
+void applyEvent(Scenario &scenario, const ScenarioEvent &event, double &containerMl, uint64_t &motionUntil) {
+  switch (event.type) {
+    case SCENARIO_TEMPERATURE:
+      scenario.tempMin = event.a;
+      scenario.tempMax = event.b;
+      break;
+    case SCENARIO_SENSOR:
+      world.sensorFail = event.a != 0;
+      break;
+    case SCENARIO_PRESS:
+      // Effects of readInput() in pulputin.ino
+      if (event.a == 4) forceStop();
+      else if (event.a == 6) resetPumpedTotal();
+      scheduleNow(TASK_PUMP);
+      break;
+    case SCENARIO_MOTION:
+      motionUntil = world.ms + (uint64_t)(event.a * ONE_MINUTE);
+      break;
+    case SCENARIO_REFILL:
+      containerMl = CONTAINER_SIZE;
+      resetPumpedTotal();
+      break;
+  }
+}
+
+void boot(const Scenario &scenario) {
+  world = SimWorld();
+  memset(world.eeprom, 0xFF, sizeof(world.eeprom));
+  world.startUnixTime = SIM_START_UNIX_TIME;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) world.moisture[zone] = 65535; // Dry
+  report = Report();
+
+  CONFIG = scenario.config;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) zones[zone] = Zone();
+  heater = HeaterController<SimHal>();
+  alarmEvaluator = AlarmEvaluator();
+  statistics = StatisticsStore<SimHal>(EEPROM_STATISTICS_START);
+  tempLimit = scenario.tempLimit;
+  heaterKp = scenario.heaterKp;
+  heaterKi = scenario.heaterKi;
+  heaterOnMsAccounted = 0;
+  heaterRunOnMs = 0;
+  pumpPortion = scenario.pumpPortion;
+  pumpDuty = scenario.pumpDuty;
+  pumpFlow = scenario.pumpFlow;
+  periodTime = scenario.periodTime;
+  moistureLimit = scenario.moistureLimit;
+  if (periodTime <= pumpTime()) {
+    fprintf(stderr, "%s: period_time must be longer than pumping a portion\n", scenario.name.c_str());
+    exit(1);
+  }
+
+  // setup() of pulputin.ino
+  timeNow = 0;
+  tasksArmed = 0;
+  previousInputs = 0;
+  temperature = tempLimit + 100;
+  temperatureFail = false;
+  tempConversionRunning = false;
+  tempLastRead = longAgo();
+  heaterSensor = TEMP_SENSOR_MIN;
+  heater.idleStartedMs = longAgo();
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) zones[zone].pump.zone = zone;
+  motionStopStartedMs = longAgo();
+  wasForceStopped = wasMotionStopped = false;
+  motionSns = false;
+
+  // New unit: resetEEPROM() clears statistics and formats the journal
+  resetUnit();
+  journal.format();
+  report.bootBlockWrites = world.eepromBlockWrites;
+  applyTunables();
+  scheduleNow(TASK_PUMP);
+  scheduleNow(TASK_HEATER);
+
+  // continueBoot()
+  initializeTempSensor();
+  assignTempSensors();
+  scheduleNow(TASK_TEMPERATURE);
+}
+
+void run(Scenario scenario) {
+  boot(scenario);
+  uint64_t endMs = scenario.days * ONE_DAY;
+  double containerMl = scenario.containerMl;
+  double soilMl[ZONE_COUNT] = {}; // Zones share the container and the air, each has its own soil
+  double soilWarmingC = 0; // Above air temperature, from the heater
+  uint64_t motionUntil = 0;
+  size_t nextEvent = 0;
+
+  auto wallStarted = std::chrono::steady_clock::now();
+  while (world.ms < endMs) {
+    while (nextEvent < scenario.events.size() && scenario.events[nextEvent].ms <= world.ms) {
+      applyEvent(scenario, scenario.events[nextEvent++], containerMl, motionUntil);
+    }
+
+    world.temperatureRaw = lround((scenarioTemperature(scenario, world.ms) + soilWarmingC) * 128);
+    world.inputs = 0;
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      if (soilMl[zone] >= scenario.soilWetMl) world.inputs |= inputWaterLevel(zone);
+      // Moisture reading falls linearly from dry soil to twice the water level sensor amount
+      world.moisture[zone] = lround(65535 * (1 - std::min(1.0, soilMl[zone] / (2 * scenario.soilWetMl))));
+    }
+    if (world.ms < motionUntil) world.inputs |= INPUT_MOTION;
+
+    auto passStarted = std::chrono::steady_clock::now();
+    controlPass();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - passStarted).count();
+    report.passes++;
+    report.passTotalNs += ns;
+    if (ns > report.passMaxNs) report.passMaxNs = ns;
+
+    uint64_t step = nextDeadline();
+    if (nextEvent < scenario.events.size() && scenario.events[nextEvent].ms - world.ms < step) {
+      step = scenario.events[nextEvent].ms - world.ms;
+    }
+    if (world.ms < motionUntil && motionUntil - world.ms < step) step = motionUntil - world.ms;
+    if (step == 0) step = 1;
+
+    // Physical world during the step
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      if (!world.pumpDuty[zone]) continue;
+      double ml = step * scenario.trueFlow.flowAt(world.pumpDuty[zone]) / 100000.0;
+      report.pumpOnMs += step;
+      if (containerMl >= ml) {
+        containerMl -= ml;
+        soilMl[zone] += ml;
+        report.soilMl += ml;
+      } else {
+        report.dryMl += ml - containerMl;
+        soilMl[zone] += containerMl;
+        report.soilMl += containerMl;
+        containerMl = 0;
+      }
+    }
+    // Average of the switching windows during the step
+    double heaterOnMs = (double)step * world.heaterDuty / HEATER_DUTY_MAX;
+    world.heaterOnMs += lround(heaterOnMs);
+    report.heaterOnMs += heaterOnMs;
+    if (scenario.heatingCPerW > 0) {
+      double steadyC = scenario.heatingCPerW * HEATER_POWER * world.heaterDuty / HEATER_DUTY_MAX;
+      soilWarmingC += (steadyC - soilWarmingC) * (1 - exp(-(double)step / (scenario.heatingHours * ONE_HOUR)));
+    }
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      soilMl[zone] -= scenario.soilDrainMlPerHour * step / ONE_HOUR;
+      if (soilMl[zone] < 0) soilMl[zone] = 0;
+    }
+
+    world.ms += step;
+    timeNow += step;
+  }
+  report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStarted).count();
+}
+
+void printTiming() {
+  printf("host: %.2f s, %.0f ns avg, %.0f ns max per control pass\n",
+    report.wallSeconds, report.passTotalNs / report.passes, report.passMaxNs);
+}
+
+// Everything but the timing, which depends on the host
+void printReport(FILE *out) {
+  double days = world.ms / (double)ONE_DAY;
+  fprintf(out, "simulated %.1f days, %u control passes\n", days, report.passes);
+  fprintf(out, "water: %u runs, pumped %.0f ml (%.0f ml/day), %.0f ml dry, counted by firmware %u ml since refill\n",
+    report.pumpRuns, report.soilMl + report.dryMl, (report.soilMl + report.dryMl) / days, report.dryMl,
+    statistics.pumpedTotal);
+  fprintf(out, "heater: %u runs, on %.1f h, duty %.2f %%, %.0f Wh\n",
+    report.heaterRuns, report.heaterOnMs / ONE_HOUR, 100.0 * report.heaterOnMs / world.ms,
+    report.heaterOnMs / ONE_HOUR * HEATER_POWER);
+
+  uint32_t maxCell = 0;
+  uint32_t cellsWritten = 0;
+  uint64_t byteWrites = 0;
+  for (uint16_t i = 0; i < SIM_EEPROM_SIZE; i++) {
+    uint32_t writes = world.eepromCellWrites[i];
+    if (writes) cellsWritten++;
+    byteWrites += writes;
+    if (writes > maxCell) maxCell = writes;
+  }
+  fprintf(out, "eeprom: %u records (%u at boot), %llu byte writes, %u cells written, max %u writes per cell",
+    world.eepromBlockWrites, report.bootBlockWrites, (unsigned long long)byteWrites, cellsWritten, maxCell);
+  if (maxCell > 1) fprintf(out, ", 100k cycle endurance in %.0f years", 100000.0 / maxCell * days / 365);
+  fprintf(out, "\n");
+  uint32_t statisticsRecords = 0;
+  for (uint8_t field = FIELD_HOUR_NUMBER; field <= FIELD_MONTH_HEATED; field++) {
+    statisticsRecords += world.fieldRecords[field];
+  }
+  // Of all zones
+  uint32_t pumpStartedRecords = 0;
+  uint32_t idleStartedRecords = 0;
+  uint32_t lastWetRecords = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    pumpStartedRecords += world.fieldRecords[pumpStartedField(zone)];
+    idleStartedRecords += world.fieldRecords[idleStartedField(zone)];
+    lastWetRecords += world.fieldRecords[lastWetField(zone)];
+  }
+  fprintf(out, "eeprom records: statistics %u, pump total %u, pump started %u, idle started %u, heater started %u, last wet %u\n",
+    statisticsRecords, world.fieldRecords[FIELD_PUMP_TOTAL], pumpStartedRecords, idleStartedRecords,
+    world.fieldRecords[FIELD_HEATER_STARTED], lastWetRecords);
+
+  // Monthly buckets hold everything counted by firmware, as long as the run is shorter than a year
+  uint64_t bucketMl = 0;
+  uint64_t bucketHeatedS = 0;
+  for (uint8_t i = 0; i < StatisticsStore<SimHal>::bucketCount(STATISTICS_MONTHLY); i++) {
+    StatisticsBucket bucket = statistics.bucket(STATISTICS_MONTHLY, i);
+    bucketMl += bucket.pumpedMl;
+    bucketHeatedS += bucket.heatedS;
+  }
+  StatisticsBucket yesterday = statistics.day(1);
+  fprintf(out, "statistics: %llu ml, heater on %.1f h in monthly buckets, yesterday %u ml, %u s, bucket writes %u\n",
+    (unsigned long long)bucketMl, bucketHeatedS / 3600.0, yesterday.pumpedMl, yesterday.heatedS,
+    world.statisticsWrites);
+
+  uint32_t alarmsOn = 0;
+  for (size_t i = 0; i < report.alarms.size(); i++) alarmsOn += report.alarms[i].on;
+  fprintf(out, "alarms: %u times on\n", alarmsOn);
+  for (size_t i = 0; i < report.alarms.size() && i < 20; i++) {
+    uint64_t s = report.alarms[i].ms / 1000;
+    fprintf(out, "  day %llu %02llu:%02llu %s\n", (unsigned long long)(s / 86400), (unsigned long long)(s / 3600 % 24),
+      (unsigned long long)(s / 60 % 60), report.alarms[i].on ? "on" : "off");
+  }
+  if (report.alarms.size() > 20) fprintf(out, "  ...\n");
+}
+
+// Expected report of a scenario, next to it: empty_container.txt has empty_container.expected
+std::string expectedFile(const std::string &scenario) {
+  size_t dot = scenario.rfind('.');
+  size_t slash = scenario.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return scenario + ".expected";
+  return scenario.substr(0, dot) + ".expected";
+}
+
+// Compares the report with the expected one and shows the first line that differs. With update
+// the report is written as the expected one instead.
+bool checkReport(const Scenario &scenario, bool update) {
+  std::string file = expectedFile(scenario.name);
+  if (update) {
+    FILE *f = fopen(file.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "%s: can not write\n", file.c_str());
+      return false;
+    }
+    printReport(f);
+    fclose(f);
+    printf("updated %s\n", file.c_str());
+    return true;
+  }
+  FILE *expected = fopen(file.c_str(), "r");
+  if (!expected) {
+    printf("FAIL %s: no %s\n", scenario.name.c_str(), file.c_str());
+    return false;
+  }
+  FILE *got = tmpfile();
+  printReport(got);
+  rewind(got);
+  char want[256];
+  char have[256];
+  int line = 0;
+  bool same = true;
+  while (same) {
+    line++;
+    bool wantEnd = !fgets(want, sizeof(want), expected);
+    bool haveEnd = !fgets(have, sizeof(have), got);
+    if (wantEnd && haveEnd) break;
+    if (wantEnd) strcpy(want, "(end)\n");
+    if (haveEnd) strcpy(have, "(end)\n");
+    same = !strcmp(want, have);
+  }
+  fclose(got);
+  fclose(expected);
+  if (same) {
+    printf("ok %s\n", scenario.name.c_str());
+  } else {
+    printf("FAIL %s:%d\n  expected: %s  got:      %s", file.c_str(), line, want, have);
+  }
+  return same;
+}
+
+int main(int argc, char **argv) {
+  // -c compares the reports with the expected ones, -u writes them
+  bool check = argc > 1 && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "-u"));
+  bool update = check && argv[1][1] == 'u';
+  int first = check ? 2 : 1;
+  if (argc <= first) {
+    fprintf(stderr, "usage: %s [-c|-u] scenario...\n", argv[0]);
+    return 2;
+  }
+  int failed = 0;
+  for (int i = first; i < argc; i++) {
+    Scenario scenario;
+    if (!loadScenario(argv[i], scenario)) {
+      fprintf(stderr, "%s: can not open\n", argv[i]);
+      return 1;
+    }
+    run(scenario);
+    if (check) {
+      if (!checkReport(scenario, update)) failed++;
+    } else {
+      printf("== %s\n", scenario.name.c_str());
+      printReport(stdout);
+      printTiming();
+    }
+  }
+  if (failed) printf("%d of %d scenarios failed\n", failed, argc - first);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_SIM_HAL_H
+#define PULPUTIN_SIM_HAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "../config.h"
+#include "../hal.h"
+#include "../journal.h"
+
+static const uint16_t SIM_EEPROM_SIZE = 4096; // ATmega2560
+
+// Zones of the simulated board, all with the same soil. Build with
+// -DSIM_ZONE_COUNT=n to simulate a multi-zone board.
+#ifndef SIM_ZONE_COUNT
+  #define SIM_ZONE_COUNT 1
+#endif
+static const uint8_t ZONE_COUNT = SIM_ZONE_COUNT;
+static_assert(ZONE_COUNT >= 1 && ZONE_COUNT <= MAX_ZONES, "Zone count");
+
+// Simulated hardware. The simulation updates sensor state between control
+// passes and reads back the outputs.
+struct SimWorld {
+  uint64_t ms; // Since start of the simulation
+  uint32_t startUnixTime;
+  int32_t temperatureRaw; // 1/128 celsius
+  bool sensorFail;
+  uint16_t inputs; // INPUT_*
+  uint16_t moisture[ZONE_COUNT];
+
+  uint8_t pumpDuty[ZONE_COUNT];
+  uint8_t heaterDuty; // Of HEATER_DUTY_MAX
+  uint32_t heaterOnMs; // Integrated by the simulation
+  bool led;
+  uint8_t beeper;
+
+  uint8_t eeprom[SIM_EEPROM_SIZE];
+  uint32_t eepromCellWrites[SIM_EEPROM_SIZE];
+  uint32_t eepromBlockWrites; // One per block write
+  uint32_t fieldRecords[256]; // Journal records written of each field
+  uint32_t statisticsWrites; // Block writes below the journal
+};
+
+extern SimWorld world;
+
+struct SimHal {
+  static void begin() {}
+
+  static uint16_t readInputs() { return world.inputs; }
+  static uint16_t readMoisture(uint8_t zone) { return world.moisture[zone]; }
+  static void resumeAfterSleep(uint16_t) {}
+  static void setPumpDuty(uint8_t zone, uint8_t duty) { world.pumpDuty[zone] = duty; }
+  static void setHeaterDuty(uint8_t duty) { world.heaterDuty = duty; }
+  static uint32_t readHeaterOnMs() { return world.heaterOnMs; }
+  static uint32_t heaterOffMs() { return world.heaterDuty ? 0 : 0xFFFFFFFF; }
+  static void setLed(bool on) { world.led = on; }
+  static void setBeeper(uint8_t duty) { world.beeper = duty; }
+
+  static uint16_t beginTemperature(uint8_t resolution) { return 750 >> (12 - resolution); }
+  // One probe on the simulated bus
+  static bool findTemperatureSensor(uint8_t index, SensorAddress &address) {
+    if (index) return false;
+    memset(&address, 0, sizeof(address));
+    address.rom[0] = 0x28; // DS18B20 family code
+    return true;
+  }
+  static void requestTemperature() {}
+  static int32_t readTemperatureRaw(const SensorAddress&) { return world.sensorFail ? TEMP_RAW_DISCONNECTED : world.temperatureRaw; }
+
+  static void beginI2c() {}
+  static void serviceBus() {}
+  static bool isBusIdle() { return true; }
+
+  static bool beginRtc() { return true; }
+  static uint32_t readRtc() { return world.startUnixTime + world.ms / 1000; }
+  static void requestRtc() {}
+  static bool rtcReady(uint32_t &unixTime) {
+    unixTime = readRtc();
+    return true;
+  }
+  static void enableRtcSquareWave() {}
+
+  static void beginLcd() {}
+  static bool setLcdCursor(uint8_t, uint8_t) { return true; }
+  static bool writeLcd(char) { return true; }
+  static void setLcdBacklight(bool) {}
+
+  static void readEeprom(uint16_t address, void *data, uint8_t size) { memcpy(data, world.eeprom + address, size); }
+
+  // Every byte of a block write is an erase and write cycle, like eeprom_write_block()
+  static void writeEeprom(uint16_t address, const void *data, uint8_t size) {
+    memcpy(world.eeprom + address, data, size);
+    for (uint8_t i = 0; i < size; i++) world.eepromCellWrites[address + i]++;
+    world.eepromBlockWrites++;
+    if (address < EEPROM_JOURNAL_START) world.statisticsWrites++;
+    else world.fieldRecords[((const JournalRecord*)data)->field]++;
+  }
+
+  static void updateEepromByte(uint16_t address, uint8_t value) {
+    if (world.eeprom[address] == value) return;
+    world.eeprom[address] = value;
+    world.eepromCellWrites[address]++;
+  }
+
+  static void resetWatchdog() {}
+
+  // Simulated board has no FRAM
+  static bool beginFram() { return false; }
+  static void readFram(uint16_t, void *data, uint8_t size) { memset(data, 0xFF, size); }
+  static void writeFram(uint16_t, const void*, uint8_t) {}
+};
+
+#endif
@@ -0,0 +1,277 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_TWI_QUEUE_H
+#define PULPUTIN_TWI_QUEUE_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+
+// Interrupt driven I2C master of the Mega, used instead of Wire with
+// USE_ASYNC_I2C. Transactions are queued and TWI_vect runs them one after
+// another, so the loop only queues work and never waits on the bus.
+//
+// A transaction writes its bytes and then, after a repeated start, reads into
+// the buffer of the caller. Bytes to be written are copied into a ring when
+// queued. Completion callback runs in the interrupt with TWI_OK or the error.
+// Wire defines TWI_vect too, so Wire and the libraries using it can not be
+// linked into the same sketch.
+
+static const uint8_t TWI_OK = 0;
+static const uint8_t TWI_NACK = 1; // Address or data not acknowledged
+static const uint8_t TWI_BUS_ERROR = 2;
+static const uint8_t TWI_TIMEOUT = 3; // Bus got stuck and was recovered
+static const uint8_t TWI_PENDING = 0xFF;
+
+static const uint8_t TWI_QUEUE_SIZE = 8; // Transactions
+static const uint8_t TWI_BUFFER_SIZE = 192; // Bytes to be written by queued transactions
+static const uint32_t TWI_FAST_HZ = 400000;
+static const uint32_t TWI_STANDARD_HZ = 100000;
+static const uint8_t TWI_TIMEOUT_MS = 10; // Without progress
+static const uint16_t TWI_STOP_SPINS = 1000; // About 300 us, a STOP takes 10 us at 100 kHz
+static const uint8_t TWI_SDA_PIN = 20;
+static const uint8_t TWI_SCL_PIN = 21;
+
+typedef void (*TwiCallback)(uint8_t status);
+
+struct TwiTransaction {
+  uint8_t address;
+  uint8_t start; // Of written bytes in the ring
+  uint8_t writeLength;
+  uint8_t readLength;
+  uint8_t *read;
+  TwiCallback done;
+};
+
+static TwiTransaction twiQueue[TWI_QUEUE_SIZE];
+static volatile uint8_t twiHead = 0; // Transaction on the bus, or next one
+static volatile uint8_t twiCount = 0;
+static volatile uint8_t twiBufferUsed = 0;
+static uint8_t twiBuffer[TWI_BUFFER_SIZE];
+static volatile bool twiStarted = false; // Head transaction is on the bus
+static uint8_t twiPosition = 0; // Bytes of the head transaction written or read
+static bool twiReading = false; // Head transaction is past its writes
+static volatile uint16_t twiProgress = 0; // Counts interrupts, see Twi::service()
+static volatile uint8_t twiRunStatus = TWI_OK;
+static volatile bool twiStopStuck = false; // STOP did not complete, see Twi::service()
+
+static const uint8_t TWCR_ENABLED = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+
+inline void twiStartHead(uint8_t control) {
+  twiStarted = true;
+  twiPosition = 0;
+  twiReading = false;
+  TWCR = control;
+}
+
+// Drops the head transaction. Returns its callback, to be called once the
+// bus has been set up for the next one.
+inline TwiCallback twiDropHead() {
+  TwiTransaction &t = twiQueue[twiHead];
+  twiBufferUsed -= t.writeLength;
+  twiHead = (twiHead + 1) % TWI_QUEUE_SIZE;
+  twiCount--;
+  twiStarted = false;
+  return t.done;
+}
+
+// Head transaction is done. Next one starts right after the stop, otherwise
+// the bus is released. The stop is waited for, like Wire does, but not in
+// the interrupt for long: a slave holding SCL low is cleared by service().
+inline void twiComplete(uint8_t status) {
+  TwiCallback done = twiDropHead();
+  if (twiCount) {
+    twiStartHead(TWCR_ENABLED | _BV(TWSTA) | _BV(TWSTO));
+  } else {
+    TWCR = TWCR_ENABLED | _BV(TWSTO);
+    uint16_t spins = 0;
+    while (TWCR & _BV(TWSTO)) {
+      if (++spins == TWI_STOP_SPINS) {
+        twiStopStuck = true;
+        break;
+      }
+    }
+  }
+  if (done) done(status);
+}
+
+ISR(TWI_vect) {
+  twiProgress++;
+  TwiTransaction &t = twiQueue[twiHead];
+  switch (TWSR & 0xF8) {
+    case 0x08: // Start
+      twiReading = !t.writeLength && t.readLength;
+      TWDR = t.address << 1 | twiReading;
+      TWCR = TWCR_ENABLED;
+      break;
+    case 0x10: // Repeated start, read follows the writes
+      TWDR = t.address << 1 | 1;
+      TWCR = TWCR_ENABLED;
+      break;
+    case 0x18: // Address and write acknowledged
+    case 0x28: // Data acknowledged
+      if (twiPosition < t.writeLength) {
+        TWDR = twiBuffer[(t.start + twiPosition++) % TWI_BUFFER_SIZE];
+        TWCR = TWCR_ENABLED;
+      } else if (t.readLength) {
+        twiReading = true;
+        TWCR = TWCR_ENABLED | _BV(TWSTA);
+      } else {
+        twiComplete(TWI_OK);
+      }
+      break;
+    case 0x40: // Address and read acknowledged
+      twiPosition = 0;
+      TWCR = t.readLength > 1 ? TWCR_ENABLED | _BV(TWEA) : TWCR_ENABLED;
+      break;
+    case 0x50: // Data received and acknowledged, more to come
+      t.read[twiPosition++] = TWDR;
+      TWCR = t.readLength - twiPosition > 1 ? TWCR_ENABLED | _BV(TWEA) : TWCR_ENABLED;
+      break;
+    case 0x58: // Last byte received
+      t.read[twiPosition] = TWDR;
+      twiComplete(TWI_OK);
+      break;
+    case 0x20: // Address and write not acknowledged
+    case 0x30: // Data not acknowledged
+    case 0x48: // Address and read not acknowledged
+      twiComplete(TWI_NACK);
+      break;
+    default: // Bus error or lost arbitration, there is no other master
+      twiComplete(TWI_BUS_ERROR);
+      break;
+  }
+}
+
+struct Twi {
+  static void begin(uint32_t hz) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      digitalWrite(TWI_SDA_PIN, HIGH); // Internal pull-ups in addition to the external ones
+      digitalWrite(TWI_SCL_PIN, HIGH);
+      TWSR = 0; // Prescaler 1
+      TWBR = (F_CPU / hz - 16) / 2;
+      TWCR = _BV(TWEN) | _BV(TWIE);
+    }
+  }
+
+  // Queue a transaction, false when there is no room. Reads go to read,
+  // which must be valid until done is called.
+  static bool queue(uint8_t address, const uint8_t *write, uint8_t writeLength, uint8_t *read, uint8_t readLength,
+      TwiCallback done) {
+    bool queued = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (twiCount < TWI_QUEUE_SIZE && TWI_BUFFER_SIZE - twiBufferUsed >= writeLength) {
+        TwiTransaction &t = twiQueue[(twiHead + twiCount) % TWI_QUEUE_SIZE];
+        t.address = address;
+        t.start = bufferEnd();
+        t.writeLength = writeLength;
+        t.readLength = readLength;
+        t.read = read;
+        t.done = done;
+        copyIn(t.start, write, writeLength);
+        twiCount++;
+        if (!twiStarted) twiStartHead(TWCR_ENABLED | _BV(TWSTA));
+        queued = true;
+      }
+    }
+    return queued;
+  }
+
+  // Like queue() for writes without callback, bytes are added to the latest
+  // transaction if it writes to the same address and has not started yet.
+  static bool append(uint8_t address, const uint8_t *write, uint8_t writeLength) {
+    bool appended = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      TwiTransaction &last = twiQueue[(twiHead + twiCount + TWI_QUEUE_SIZE - 1) % TWI_QUEUE_SIZE];
+      bool open = twiCount > (twiStarted ? 1 : 0) && last.address == address && !last.readLength && !last.done &&
+        last.writeLength <= 0xFF - writeLength;
+      if (open && TWI_BUFFER_SIZE - twiBufferUsed >= writeLength) {
+        copyIn(bufferEnd(), write, writeLength);
+        last.writeLength += writeLength;
+        appended = true;
+      }
+    }
+    return appended || queue(address, write, writeLength, NULL, 0, NULL);
+  }
+
+  // Queue and wait until done, for boot and data needed at once. The wait is
+  // bounded by the timeout of service().
+  static uint8_t run(uint8_t address, const uint8_t *write, uint8_t writeLength, uint8_t *read, uint8_t readLength) {
+    // Before queueing, the transaction may be done before queue() returns
+    twiRunStatus = TWI_PENDING;
+    while (!queue(address, write, writeLength, read, readLength, onRunDone)) service(millis());
+    while (twiRunStatus == TWI_PENDING) service(millis());
+    return twiRunStatus;
+  }
+
+  static bool idle() { return !twiCount; }
+
+  // Called on every loop iteration. A transaction that makes no progress in
+  // TWI_TIMEOUT_MS has a stuck bus, usually a slave holding SDA low in the
+  // middle of a byte. It is clocked out, the transaction fails and the bus
+  // falls back to standard speed. A stop that did not complete is recovered
+  // the same way, the transaction before it was already done.
+  static void service(uint32_t now) {
+    static uint16_t seenProgress = 0;
+    static uint32_t progressMs = 0;
+    if (twiStopStuck) {
+      recover();
+      return;
+    }
+    if (!twiStarted || twiProgress != seenProgress) {
+      seenProgress = twiProgress;
+      progressMs = now;
+      return;
+    }
+    if (now - progressMs < TWI_TIMEOUT_MS) return;
+    progressMs = now;
+    recover();
+  }
+
+  static uint8_t recoveries; // Of a stuck bus, since boot
+
+private:
+  static uint8_t bufferEnd() {
+    uint8_t start = twiCount ? twiQueue[twiHead].start : 0;
+    return (start + twiBufferUsed) % TWI_BUFFER_SIZE;
+  }
+
+  static void copyIn(uint8_t start, const uint8_t *bytes, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) twiBuffer[(start + i) % TWI_BUFFER_SIZE] = bytes[i];
+    twiBufferUsed += length;
+  }
+
+  static void onRunDone(uint8_t status) { twiRunStatus = status; }
+
+  static void recover() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      TWCR = 0; // Pins back to port control
+      pinMode(TWI_SDA_PIN, INPUT_PULLUP);
+      pinMode(TWI_SCL_PIN, OUTPUT);
+      for (uint8_t i = 0; i < 9 && !digitalRead(TWI_SDA_PIN); i++) {
+        digitalWrite(TWI_SCL_PIN, LOW);
+        delayMicroseconds(5);
+        digitalWrite(TWI_SCL_PIN, HIGH);
+        delayMicroseconds(5);
+      }
+      // Stop condition: SDA rises while SCL is high
+      pinMode(TWI_SDA_PIN, OUTPUT);
+      digitalWrite(TWI_SDA_PIN, LOW);
+      delayMicroseconds(5);
+      pinMode(TWI_SDA_PIN, INPUT_PULLUP);
+      pinMode(TWI_SCL_PIN, INPUT_PULLUP);
+      begin(TWI_STANDARD_HZ);
+      recoveries++;
+      // After a stuck stop a transaction queued since has not got anywhere, it is started again
+      bool stopStuck = twiStopStuck;
+      twiStopStuck = false;
+      TwiCallback done = stopStuck ? NULL : twiDropHead();
+      if (twiCount) twiStartHead(TWCR_ENABLED | _BV(TWSTA));
+      if (done) done(TWI_TIMEOUT);
+    }
+  }
+};
+
+uint8_t Twi::recoveries = 0;
+
+#endif
@@ -0,0 +1,577 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_UNIT_H
+#define PULPUTIN_UNIT_H
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "control.h"
+#include "fields.h"
+#include "journal.h"
+
+// State of the unit and the glue between the control classes, the task
+// scheduler and the journal. Shared by pulputin.ino and the simulation in
+// sim/, so that the simulation runs the bookkeeping of the firmware. Included
+// once, into the translation unit that defines Hal, CONFIG and the functions
+// below.
+
+// Telemetry, see sendZoneEvent() of pulputin.ino
+void sendZoneEvent(uint8_t type, uint8_t zone, int32_t value);
+// Shown values changed, the display is refreshed
+void invalidateLcd();
+// Hour, day and month numbers of the clock, see StatisticsStore
+uint32_t currentHour();
+uint16_t currentDay();
+uint16_t currentMonth();
+
+// Telemetry events. Each is sent as one line: "<code> <unixtime> <value>".
+static const uint8_t EVENT_PUMP_START = 0;
+static const uint8_t EVENT_PUMP_STOP = 1; // value: pumped ml
+static const uint8_t EVENT_HEATER_START = 2;
+static const uint8_t EVENT_HEATER_STOP = 3; // value: heater on time in ms since start
+static const uint8_t EVENT_TEMPERATURE = 4; // value: hundredths of celsius
+static const uint8_t EVENT_ALARM = 5; // value: 1 on, 0 off
+static const uint8_t EVENT_DISPLAY_MODE = 6; // value: DISPLAY_*
+static const uint8_t EVENT_DROPPED = 7; // value: events dropped since previous report
+static const uint8_t EVENT_RESET = 8; // At boot. value: MCUSR bits, breadcrumb stage << 8 or 0xFF00 if none
+
+void sendEvent(uint8_t type, int32_t value) { sendZoneEvent(type, 0, value); }
+
+// Times, in milliseconds since EPOCH_OFFSET. They wrap around every ~49 days,
+// so they must only be compared through differences, like timeNow - heater.startedMs.
+uint32_t timeNow = 0;
+
+// Tasks are run by loop() only when their deadline has passed. Each task re-arms
+// itself for its next timed event, and events (input changes, new temperature)
+// re-arm dependent tasks immediately.
+static const uint8_t TASK_CLOCK = 0;
+static const uint8_t TASK_TEMPERATURE = 1;
+static const uint8_t TASK_PUMP = 2;
+static const uint8_t TASK_HEATER = 3;
+static const uint8_t TASK_BLINK = 4;
+static const uint8_t TASK_EEPROM = 5;
+static const uint8_t TASK_LCD = 6;
+static const uint8_t TASK_LOG = 7;
+static const uint8_t TASK_UPLINK = 8;
+static const uint8_t TASK_COUNT = 9;
+
+uint32_t taskDeadlines[TASK_COUNT];
+uint16_t tasksArmed = 0; // Bit per task
+
+void schedule(uint8_t task, uint32_t deadline) {
+  taskDeadlines[task] = deadline;
+  tasksArmed |= 1 << task;
+}
+void scheduleNow(uint8_t task) { schedule(task, timeNow); }
+void scheduleNever(uint8_t task) { tasksArmed &= ~(1 << task); }
+bool isArmed(uint8_t task) { return tasksArmed & (1 << task); }
+void scheduleEarlier(uint8_t task, uint32_t deadline) {
+  if (!isArmed(task) || (int32_t)(deadline - taskDeadlines[task]) < 0) schedule(task, deadline);
+}
+bool taskDue(uint8_t task) { return isArmed(task) && (int32_t)(timeNow - taskDeadlines[task]) >= 0; }
+
+// Milliseconds until the earliest armed task deadline
+uint32_t timeToNextDeadline(uint32_t maxTime) {
+  uint32_t next = maxTime;
+  for (uint8_t task = 0; task < TASK_COUNT; task++) {
+    if (!isArmed(task)) continue;
+    int32_t left = taskDeadlines[task] - timeNow;
+    if (left <= 0) return 0;
+    if ((uint32_t)left < next) next = left;
+  }
+  return next;
+}
+
+// Divide with rounding to nearest, also for negative values
+int32_t divRound(int32_t value, int32_t divisor) {
+  return (value < 0 ? value - divisor / 2 : value + divisor / 2) / divisor;
+}
+
+// Tunables can be changed over the serial protocol and are persisted in the journal
+int16_t tempLimit = 500; // Heater is used below this temperature
+uint16_t heaterKp = 100; // Heater duty permille per celsius below tempLimit
+uint16_t heaterKi = 100; // Heater duty permille per celsius hour below tempLimit
+uint16_t pumpPortion = 100; // Amount of water pumped at once (ml)
+uint32_t periodTime = 15*ONE_MINUTE; // Adjusted water amount is pumpPortion / periodTime.
+uint8_t moistureLimit = 0; // Pumping does not start while moisture is at least this percent, 0 disables
+uint8_t pumpDuty = 100; // Percent of full pump speed, slower doses soak in better
+PumpFlow pumpFlow = {{30, 60, 88, 106}}; // Calibration, ml per 100 s at 25, 50, 75 and 100 % duty
+
+uint16_t heaterMaxDuty() { return HEATER_PERMILLE * TARGET_POWER / HEATER_POWER; }
+uint8_t pumpDutyPwm() { return (uint16_t)pumpDuty * PUMP_DUTY_MAX / 100; }
+uint32_t pumpTime() { return pumpFlow.runTimeMs(pumpDutyPwm(), pumpPortion); }
+uint32_t idleTime() { return periodTime - pumpTime(); }
+
+// State of each pot, see ZONE_PINS of the HAL. Tunables are shared by all zones.
+struct Zone {
+  PumpController<Hal> pump;
+  bool waterLevel = false;
+  bool wasWet = false;
+  bool moistureWet = false; // Soil moisture has reached moistureLimit
+  uint8_t moisturePercent = 0;
+  uint32_t lastWetMs = 0;
+  uint16_t pumpedTodayMl = 0;
+};
+
+Zone zones[ZONE_COUNT];
+HeaterController<Hal> heater;
+uint32_t heaterOnMsAccounted = 0; // Of Hal::readHeaterOnMs(), already in the statistics
+uint32_t heaterRunOnMs = 0; // Heater on time since the heater started
+AlarmEvaluator alarmEvaluator;
+
+StatisticsStore<Hal> statistics(EEPROM_STATISTICS_START);
+
+// Defined by the includer, with fieldData() falling back to unitFieldData()
+extern Journal<Hal, FIELD_COUNT> journal;
+
+bool motionSns = false;
+uint32_t forceStopStartedMs = 0;
+uint32_t motionStopStartedMs = 0;
+bool wasMotionStopped = false;
+bool wasForceStopped = false;
+
+// Temperature probes, like soil, container water and air. ROM codes are found by
+// a bus search once and kept in the journal, so a probe keeps its number when
+// others are added or do not answer. Temperatures are then read by address.
+static const uint8_t TEMP_SENSOR_COUNT = 3;
+static const uint8_t TEMP_SENSOR_MIN = TEMP_SENSOR_COUNT; // heaterSensor: lowest of the working probes
+
+struct TempSensor {
+  SensorAddress address; // All zero when no probe is assigned
+  int16_t temperature; // Hundredths of celsius
+  bool fail;
+};
+
+TempSensor tempSensors[TEMP_SENSOR_COUNT];
+uint8_t heaterSensor = TEMP_SENSOR_MIN; // Probe giving temperature, or TEMP_SENSOR_MIN
+
+int16_t temperature = tempLimit + 100; // in hundredths of celsius, from heaterSensor
+bool temperatureFail = false; // Probe of heaterSensor did not answer
+bool tempConversionRunning = false;
+uint16_t tempConversionTime = 750; // ms, updated from TEMP_RESOLUTION in setup()
+uint32_t tempLastRead = 0;
+uint32_t tempConversionStartedMs = 0;
+
+// Fields of the control state. Fields of zones not wired on this board are
+// left as they are.
+void* unitFieldData(uint8_t field, uint8_t &size) {
+  switch (field) {
+    case FIELD_PUMP_TOTAL: size = sizeof(statistics.pumpedTotal); return &statistics.pumpedTotal;
+    case FIELD_HEATER_STARTED: size = sizeof(heater.startedMs); return &heater.startedMs;
+    case FIELD_TEMP_LIMIT: size = sizeof(tempLimit); return &tempLimit;
+    case FIELD_HEATER_KP: size = sizeof(heaterKp); return &heaterKp;
+    case FIELD_HEATER_KI: size = sizeof(heaterKi); return &heaterKi;
+    case FIELD_PUMP_DUTY: size = sizeof(pumpDuty); return &pumpDuty;
+    case FIELD_PUMP_PORTION: size = sizeof(pumpPortion); return &pumpPortion;
+    case FIELD_PERIOD_TIME: size = sizeof(periodTime); return &periodTime;
+    case FIELD_MOISTURE_LIMIT: size = sizeof(moistureLimit); return &moistureLimit;
+    case FIELD_HEATER_SENSOR: size = sizeof(heaterSensor); return &heaterSensor;
+    case FIELD_HOUR_NUMBER: size = sizeof(statistics.hourNumber); return &statistics.hourNumber;
+    case FIELD_DAY_NUMBER: size = sizeof(statistics.dayNumber); return &statistics.dayNumber;
+    case FIELD_MONTH_NUMBER: size = sizeof(statistics.monthNumber); return &statistics.monthNumber;
+    case FIELD_HOUR_PUMPED: size = sizeof(statistics.hourPumpedMl); return &statistics.hourPumpedMl;
+    case FIELD_HOUR_HEATED: size = sizeof(statistics.hourHeatedMs); return &statistics.hourHeatedMs;
+    case FIELD_DAY_PUMPED: size = sizeof(statistics.dayPumpedMl); return &statistics.dayPumpedMl;
+    case FIELD_DAY_HEATED: size = sizeof(statistics.dayHeatedS); return &statistics.dayHeatedS;
+    case FIELD_MONTH_PUMPED: size = sizeof(statistics.monthPumpedMl); return &statistics.monthPumpedMl;
+    case FIELD_MONTH_HEATED: size = sizeof(statistics.monthHeatedS); return &statistics.monthHeatedS;
+  }
+  if (field >= FIELD_PUMP_FLOW && field < FIELD_PUMP_FLOW + PUMP_FLOW_POINTS) {
+    size = sizeof(pumpFlow.flow[0]);
+    return &pumpFlow.flow[field - FIELD_PUMP_FLOW];
+  }
+  if (field >= FIELD_TEMP_SENSOR_ROM && field < FIELD_TEMP_SENSOR_ROM + TEMP_SENSOR_COUNT * 2) {
+    uint8_t half = field - FIELD_TEMP_SENSOR_ROM;
+    size = sizeof(SensorAddress) / 2;
+    return tempSensors[half / 2].address.rom + half % 2 * size;
+  }
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    if (field == pumpStartedField(zone)) { size = sizeof(z.pump.startedMs); return &z.pump.startedMs; }
+    if (field == idleStartedField(zone)) { size = sizeof(z.pump.idleStartedMs); return &z.pump.idleStartedMs; }
+    if (field == lastWetField(zone)) { size = sizeof(z.lastWetMs); return &z.lastWetMs; }
+    if (field == FIELD_ZONE_PUMPED_TODAY + zone) { size = sizeof(z.pumpedTodayMl); return &z.pumpedTodayMl; }
+  }
+  size = 0;
+  return NULL;
+}
+
+void markDirty(uint8_t field) {
+  journal.markDirty(field);
+  scheduleEarlier(TASK_EEPROM, isCriticalField(field) ? timeNow : timeNow + EEPROM_WRITEBACK_TIME);
+}
+
+void markStatisticsDirty() {
+  for (uint8_t field = FIELD_HOUR_NUMBER; field <= FIELD_MONTH_HEATED; field++) {
+    markDirty(field);
+  }
+}
+
+// Write dirty fields to the journal after the write-back deadline has passed.
+// A record of 8 bytes blocks for ~27 ms, so one is written per loop iteration.
+void flushEeprom() {
+  if (!journal.flush()) return;
+  // Fields changed during the round wait for a deadline of their own
+  scheduleNever(TASK_EEPROM);
+  for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+    if (journal.isDirty(field)) markDirty(field);
+  }
+}
+
+uint32_t longAgo() { return timeNow - MAX_TIMESTAMP_AGE; }
+
+bool ageTimestamp(uint32_t &timestamp) {
+  if (timeNow - timestamp <= MAX_TIMESTAMP_AGE) return false;
+  timestamp = longAgo();
+  return true;
+}
+
+void ageTimestamps() {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    if (ageTimestamp(z.pump.startedMs)) markDirty(pumpStartedField(zone));
+    if (ageTimestamp(z.pump.idleStartedMs)) markDirty(idleStartedField(zone));
+    if (ageTimestamp(z.lastWetMs)) markDirty(lastWetField(zone));
+  }
+  if (ageTimestamp(heater.startedMs)) markDirty(FIELD_HEATER_STARTED);
+  ageTimestamp(heater.idleStartedMs);
+  ageTimestamp(forceStopStartedMs);
+  ageTimestamp(motionStopStartedMs);
+}
+
+bool anyPumpRunning() {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (zones[zone].pump.running) return true;
+  }
+  return false;
+}
+
+void updateBuiltinLed() {
+  Hal::setLed(heater.running || anyPumpRunning());
+}
+
+// Heater on time counted by the HAL is added to the statistics as it accumulates
+void accountHeating() {
+  uint32_t onMs = Hal::readHeaterOnMs();
+  uint32_t heated = onMs - heaterOnMsAccounted;
+  if (!heated) return;
+  heaterOnMsAccounted = onMs;
+  heaterRunOnMs += heated;
+  statistics.addHeated(heated);
+  markDirty(FIELD_HOUR_HEATED);
+  invalidateLcd(); // Heated today is shown
+}
+
+// Statistics roll over at hour, day and month boundaries of the clock. Returns
+// ROLLED_* of the buckets that ended.
+uint8_t rollOverStatistics() {
+  if (currentHour() != statistics.hourNumber) accountHeating();
+  uint8_t rolled = statistics.rollOver(currentHour(), currentDay(), currentMonth());
+  if (!rolled) return 0;
+  markStatisticsDirty();
+  if (rolled & ROLLED_DAY) {
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      zones[zone].pumpedTodayMl = 0;
+      markDirty(FIELD_ZONE_PUMPED_TODAY + zone);
+    }
+    ageTimestamps();
+  }
+  invalidateLcd();
+  return rolled;
+}
+
+bool isAssigned(uint8_t sensor) {
+  for (uint8_t i = 0; i < sizeof(SensorAddress); i++) {
+    if (tempSensors[sensor].address.rom[i]) return true;
+  }
+  return false;
+}
+
+void markTempSensorDirty(uint8_t sensor) {
+  markDirty(FIELD_TEMP_SENSOR_ROM + sensor * 2);
+  markDirty(FIELD_TEMP_SENSOR_ROM + sensor * 2 + 1);
+}
+
+// Probes found on the bus and not known yet get the first free numbers. Called
+// once the journal has been read. Probes that are gone keep their numbers.
+void assignTempSensors() {
+  SensorAddress found;
+  for (uint8_t index = 0; Hal::findTemperatureSensor(index, found); index++) {
+    uint8_t free = TEMP_SENSOR_COUNT;
+    bool known = false;
+    for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+      if (!memcmp(&tempSensors[sensor].address, &found, sizeof(found))) known = true;
+      else if (free == TEMP_SENSOR_COUNT && !isAssigned(sensor)) free = sensor;
+    }
+    if (known || free == TEMP_SENSOR_COUNT) continue;
+    tempSensors[free].address = found;
+    markTempSensorDirty(free);
+  }
+}
+
+void clearTempSensors() {
+  for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+    memset(&tempSensors[sensor].address, 0, sizeof(SensorAddress));
+    tempSensors[sensor].fail = false;
+  }
+}
+
+// State of a new unit, before the journal is formatted
+void resetUnit() {
+  statistics.clear(currentHour(), currentDay(), currentMonth());
+  statistics.pumpedTotal = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    z.pump.startedMs = timeNow;
+    z.pump.idleStartedMs = timeNow;
+    z.lastWetMs = longAgo();
+    z.pumpedTodayMl = 0;
+  }
+  forceStopStartedMs = longAgo();
+  clearTempSensors();
+}
+
+// Temperature of heaterSensor, false when there is none
+bool heaterTemperature(int16_t &value) {
+  if (heaterSensor < TEMP_SENSOR_COUNT) {
+    value = tempSensors[heaterSensor].temperature;
+    return isAssigned(heaterSensor) && !tempSensors[heaterSensor].fail;
+  }
+  bool found = false;
+  for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+    const TempSensor &probe = tempSensors[sensor];
+    if (!isAssigned(sensor) || probe.fail) continue;
+    if (!found || probe.temperature < value) value = probe.temperature;
+    found = true;
+  }
+  return found;
+}
+
+// Temperature used for control is missing or any assigned probe does not answer
+bool tempSensorFail() {
+  if (temperatureFail) return true;
+  for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+    if (tempSensors[sensor].fail) return true;
+  }
+  return false;
+}
+
+void readTempSensors() {
+  for (uint8_t sensor = 0; sensor < TEMP_SENSOR_COUNT; sensor++) {
+    if (!isAssigned(sensor)) continue;
+    TempSensor &probe = tempSensors[sensor];
+    // Raw temperature is in 1/128 celsius
+    int32_t raw = Hal::readTemperatureRaw(probe.address);
+    probe.fail = raw == TEMP_RAW_DISCONNECTED;
+    if (!probe.fail) probe.temperature = divRound(raw * 25, 32);
+  }
+}
+
+void initializeTempSensor() {
+  tempConversionTime = Hal::beginTemperature(TEMP_RESOLUTION);
+}
+
+// Temperature is read asynchronously: conversion is started and the result
+// is collected on a later loop iteration once conversion time has passed.
+void readTemperature() {
+  if (tempConversionRunning) {
+    if (timeNow - tempConversionStartedMs < tempConversionTime) {
+      schedule(TASK_TEMPERATURE, tempConversionStartedMs + tempConversionTime);
+      return;
+    }
+
+    int16_t shownTemperature = divRound(temperature, 10);
+    bool sensorFailed = tempSensorFail();
+    readTempSensors();
+    temperatureFail = !heaterTemperature(temperature);
+    if (!temperatureFail) {
+      sendEvent(EVENT_TEMPERATURE, temperature);
+    } else {
+      temperature = tempLimit + 100;
+    }
+    tempConversionRunning = false;
+    scheduleNow(TASK_PUMP);
+    scheduleNow(TASK_HEATER);
+    // Display shows tenths of celsius
+    if (divRound(temperature, 10) != shownTemperature || tempSensorFail() != sensorFailed) invalidateLcd();
+  } else if (timeNow - tempLastRead > TEMP_READ_INTERVAL) {
+    Hal::requestTemperature();
+    tempConversionStartedMs = timeNow;
+    tempConversionRunning = true;
+    tempLastRead = timeNow;
+  }
+  schedule(TASK_TEMPERATURE, tempConversionRunning ? tempConversionStartedMs + tempConversionTime : tempLastRead + TEMP_READ_INTERVAL + 1);
+}
+
+// Motion, moisture and water level of the debounced inputs, INPUT_* bits
+void readSensors(uint16_t input) {
+  motionSns = input & INPUT_MOTION;
+  if(motionSns) {
+    motionStopStartedMs = timeNow;
+    wasMotionStopped = true;
+  }
+
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    // Filtered in the background, reading it costs nothing
+    z.moisturePercent = 100 - (uint32_t)Hal::readMoisture(zone) * 100 / 65535;
+    bool wet = moistureLimit && z.moisturePercent >= (z.moistureWet ? moistureLimit - MOISTURE_HYSTERESIS : moistureLimit);
+    if (wet != z.moistureWet) {
+      z.moistureWet = wet;
+      scheduleNow(TASK_PUMP);
+      invalidateLcd();
+    }
+    z.waterLevel = input & inputWaterLevel(zone);
+  }
+}
+
+// Button 4 holds pumping back for CONFIG.forceStopTime
+void forceStop() {
+  forceStopStartedMs = timeNow;
+  wasForceStopped = true;
+}
+
+// Container was refilled
+void resetPumpedTotal() {
+  statistics.pumpedTotal = 0;
+  markDirty(FIELD_PUMP_TOTAL);
+}
+
+void heaterStarted() {
+  heaterRunOnMs = 0;
+  sendEvent(EVENT_HEATER_START, 0);
+  updateBuiltinLed();
+  invalidateLcd();
+}
+
+void heaterStopped() {
+  sendEvent(EVENT_HEATER_STOP, heaterRunOnMs);
+  updateBuiltinLed();
+  markDirty(FIELD_HEATER_STARTED);
+  invalidateLcd();
+}
+
+void pumpStarted(uint8_t zone) {
+  sendZoneEvent(EVENT_PUMP_START, zone, 0);
+  updateBuiltinLed();
+  markDirty(pumpStartedField(zone));
+  invalidateLcd();
+}
+
+void pumpStopped(uint8_t zone) {
+  Zone &z = zones[zone];
+  uint32_t pumped = pumpFlow.volumeMl(z.pump.duty, z.pump.lastRunTime());
+  sendZoneEvent(EVENT_PUMP_STOP, zone, pumped);
+  statistics.addPumped(pumped);
+  z.pumpedTodayMl += pumped;
+  updateBuiltinLed();
+  markDirty(FIELD_HOUR_PUMPED);
+  markDirty(FIELD_PUMP_TOTAL);
+  markDirty(idleStartedField(zone));
+  markDirty(FIELD_ZONE_PUMPED_TODAY + zone);
+  invalidateLcd();
+}
+
+int32_t leftWaterMl() { return (int32_t)CONTAINER_SIZE - statistics.pumpedTotal; }
+
+bool wetRecently(uint8_t zone) { return zones[zone].wasWet && (timeNow - zones[zone].lastWetMs < CONFIG.wetTime); }
+
+// Any pot has not been wet for too long
+bool dryTooLong() {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (timeNow - zones[zone].lastWetMs > CONFIG.dryTooLongTime) return true;
+  }
+  return false;
+}
+
+bool forceStoppedRecently() { return wasForceStopped && (timeNow - forceStopStartedMs < CONFIG.forceStopTime); }
+bool motionStoppedRecently() {
+  return CONFIG.motionStop && wasMotionStopped && (timeNow - motionStopStartedMs < CONFIG.motionStopTime);
+}
+
+bool isTriggerTemp() { return heater.isTriggerTemp(temperature); }
+
+// Constant unless the season is switched by month
+bool isWinter() {
+  if (CONFIG.season != SEASON_AUTO) return CONFIG.season == SEASON_WINTER;
+  return CONFIG.isWinterMonth(currentMonth() % 12 + 1);
+}
+
+bool isPumpSeason() { return CONFIG.canPump() && !isWinter(); }
+
+bool cantStart(uint8_t zone) {
+  return !isPumpSeason() || isTriggerTemp() || wetRecently(zone) || zones[zone].moistureWet || forceStoppedRecently() || motionStoppedRecently();
+}
+
+// Copy settings to the controllers, after tunables are loaded or changed
+void applyTunables() {
+  alarmEvaluator.tempAlarmLow = TEMP_ALARM_LOW;
+  alarmEvaluator.lowWaterMl = LOW_WATER_ALARM;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    zones[zone].pump.duty = pumpDutyPwm();
+    zones[zone].pump.pumpTime = pumpTime();
+    zones[zone].pump.idleTime = idleTime();
+  }
+  heater.tempLimit = tempLimit;
+  heater.maxDuty = heaterMaxDuty();
+  heater.kp = heaterKp;
+  heater.ki = heaterKi;
+}
+
+// Water level is tracked on every loop iteration, pump itself is managed by TASK_PUMP.
+void trackWaterLevel() {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    z.pump.trackWaterLevel(z.waterLevel);
+
+    if (z.pump.maxWaterLevel) {
+      z.lastWetMs = timeNow;
+      markDirty(lastWetField(zone));
+      z.wasWet = true;
+    }
+  }
+}
+
+// All zones are updated in one pass, TASK_PUMP is due at the earliest next event
+void manageWaterPump() {
+  scheduleNever(TASK_PUMP);
+  if (!CONFIG.canPump()) return;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    Zone &z = zones[zone];
+    uint8_t action = z.pump.update(timeNow, z.waterLevel, cantStart(zone));
+    if (action == ACTION_STARTED) pumpStarted(zone);
+    else if (action == ACTION_STOPPED) pumpStopped(zone);
+    else if (action == ACTION_IDLE_RESTARTED) markDirty(idleStartedField(zone));
+    scheduleEarlier(TASK_PUMP, z.pump.nextEvent());
+  }
+}
+
+// Duty is updated with each temperature reading, switching itself is done by the HAL
+void manageHeater() {
+  if (!CONFIG.heater) {
+    scheduleNever(TASK_HEATER);
+    return;
+  }
+  accountHeating();
+  uint8_t action = heater.update(timeNow, temperature, !temperatureFail);
+  if (action == ACTION_STARTED) heaterStarted();
+  else if (action == ACTION_STOPPED) heaterStopped();
+  scheduleNever(TASK_HEATER);
+}
+
+// Alarm conditions of the current state, bootInfo is up to the includer
+AlarmConditions alarmConditions() {
+  AlarmConditions conditions;
+  conditions.winter = !isPumpSeason(); // No water alarms
+  conditions.bootInfo = false;
+  conditions.tempSensorFail = tempSensorFail();
+  conditions.temperature = temperature;
+  conditions.dryTooLong = dryTooLong();
+  conditions.leftWaterMl = leftWaterMl();
+  conditions.forceStopped = forceStoppedRecently();
+  return conditions;
+}
+
+#endif
@@ -0,0 +1,120 @@
+// Copyright (C) 2023 Tuomas Airaksinen
+// License: GPL. See GPL.txt for more info
+
+#ifndef PULPUTIN_UPLINK_H
+#define PULPUTIN_UPLINK_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Telemetry for a radio or Wi-Fi coprocessor on a spare UART, which forwards
+// each frame as is. Records are collected into a batch sent on a schedule, an
+// alarm is sent at once in a frame of its own. Frames use the framing of the
+// serial protocol:
+//   0x7E, command, payload length, payload, checksum
+// Payload of both starts with uint8 sequence number, shared by the frame types
+// so that lost frames can be told, and uint32 unix time.
+//
+// Batch payload continues with uint8 record count and the records. A record is
+// uint8 kind | zone << 5, then varint seconds since the previous record (the
+// first one since the time of the frame) and zigzag varint value. Varints are
+// 7 bits per byte, low bits first, high bit set when more bytes follow.
+
+static const uint8_t UPLINK_FRAME_BATCH = 0x41;
+static const uint8_t UPLINK_FRAME_ALARM = 0x42; // See UplinkAlarm
+static const uint8_t UPLINK_FRAME_SYNC = 0x7E;
+static const uint8_t UPLINK_PAYLOAD_SIZE = 96; // Fits in a LoRa packet with the framing
+static const uint8_t UPLINK_FRAME_SIZE = UPLINK_PAYLOAD_SIZE + 4;
+
+// Record kinds. Below 16 they are telemetry events, EVENT_* of pulputin.ino.
+static const uint8_t UPLINK_HOUR_PUMPED = 16; // ml pumped in the hour that ended
+static const uint8_t UPLINK_HOUR_HEATED = 17; // s heated in the hour that ended
+static const uint8_t UPLINK_WATER_LEFT = 18; // ml left in the container
+static const uint8_t UPLINK_WATER_LEVEL = 19; // Bit per zone wet
+static const uint8_t UPLINK_DROPPED = 20; // Records dropped since the previous report
+
+static const uint8_t UPLINK_HEADER_SIZE = 6; // Sequence, time and count
+static const uint8_t UPLINK_RECORD_MAX = 11;
+
+// Alarm payload
+struct UplinkAlarm {
+  uint8_t sequence;
+  uint32_t time;
+  uint8_t running; // Alarm on
+  uint8_t flags; // UPLINK_ALARM_*
+  int16_t temperature; // Hundredths of celsius
+  int32_t leftWaterMl;
+} __attribute__((packed));
+
+static const uint8_t UPLINK_ALARM_SENSOR_FAIL = 1;
+static const uint8_t UPLINK_ALARM_DRY_TOO_LONG = 2;
+static const uint8_t UPLINK_ALARM_FORCE_STOPPED = 4;
+static const uint8_t UPLINK_ALARM_WINTER = 8;
+
+// Frame around a payload, returns length of the frame
+inline uint8_t uplinkFrame(uint8_t *frame, uint8_t command, const void *payload, uint8_t length) {
+  frame[0] = UPLINK_FRAME_SYNC;
+  frame[1] = command;
+  frame[2] = length;
+  memcpy(frame + 3, payload, length);
+  uint8_t sum = 0;
+  for (uint8_t i = 1; i < length + 3; i++) sum += frame[i];
+  frame[length + 3] = sum;
+  return length + 4;
+}
+
+class UplinkBatch {
+public:
+  uint8_t count = 0;
+
+  // False if the record does not fit, the batch has to be sent first
+  bool add(uint8_t kind, uint8_t zone, uint32_t unixTime, int32_t value) {
+    if (!count) {
+      firstTime = unixTime;
+      previousTime = unixTime;
+      used = UPLINK_HEADER_SIZE;
+    }
+    uint8_t record[UPLINK_RECORD_MAX];
+    record[0] = kind | zone << 5;
+    // Clock corrections may step time back, those records get the time of the previous one
+    uint32_t delta = (int32_t)(unixTime - previousTime) > 0 ? unixTime - previousTime : 0;
+    uint8_t length = 1 + putVarint(record + 1, delta);
+    length += putVarint(record + length, (uint32_t)value << 1 ^ (uint32_t)(value >> 31));
+    if (used + length > UPLINK_PAYLOAD_SIZE) return false;
+    memcpy(payload + used, record, length);
+    used += length;
+    previousTime += delta;
+    count++;
+    return true;
+  }
+
+  // Room for a record of any size is left
+  bool hasRoom() const { return !count || used + UPLINK_RECORD_MAX <= UPLINK_PAYLOAD_SIZE; }
+
+  // Frame the batch into frame and start a new one. Returns frame length.
+  uint8_t take(uint8_t *frame, uint8_t sequence) {
+    payload[0] = sequence;
+    memcpy(payload + 1, &firstTime, sizeof(firstTime));
+    payload[5] = count;
+    count = 0;
+    return uplinkFrame(frame, UPLINK_FRAME_BATCH, payload, used);
+  }
+
+private:
+  uint8_t payload[UPLINK_PAYLOAD_SIZE];
+  uint8_t used = UPLINK_HEADER_SIZE;
+  uint32_t firstTime = 0;
+  uint32_t previousTime = 0;
+
+  static uint8_t putVarint(uint8_t *out, uint32_t value) {
+    uint8_t length = 0;
+    while (value >= 0x80) {
+      out[length++] = value | 0x80;
+      value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+  }
+};
+
+#endif